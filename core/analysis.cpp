@@ -0,0 +1,448 @@
+#include <daisa/analysis.hpp>
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+using namespace daisa;
+using namespace daisa::analysis;
+
+namespace {
+
+  constexpr u32 none = ~u32(0);
+
+  // what is known of the accumulator when an instruction runs, from every path to it seen so far
+  struct Accumulator {
+    bool reached = false;
+    bool known = false;
+    u8 value = 0;
+
+    // returns whether it changed
+    bool merge(Accumulator in) {
+      if (!reached) {
+        *this = in;
+        return true;
+      }
+      if (known && (!in.known || in.value != value)) {
+        known = false;
+        return true;
+      }
+      return false;
+    }
+  };
+
+  struct Node {
+    u16 addr = 0;
+    // with the callee's worst case, for a call
+    u64 cost = 0;
+    // 1 for a push, -1 for a pop
+    i32 push = 0;
+    u32 calleeStack = 0;
+    std::array<u32, 2> succ{ none, none };
+    // ret, iret or hlt
+    bool exit = false;
+    Accumulator a;
+  };
+
+  struct Loop {
+    u32 header;
+    // every instruction in it, including those of loops inside it
+    std::vector<u32> body;
+  };
+
+  bool keepsAccumulator(OpCode op) {
+    switch (op) {
+      case OpCode::NOP: case OpCode::JF: case OpCode::JN: case OpCode::Jc:
+      case OpCode::PUSH: case OpCode::POP: case OpCode::PUSH_CSR: case OpCode::POP_CSR: case OpCode::STA_CSR:
+      case OpCode::LDDS: case OpCode::STDS: case OpCode::LDSS: case OpCode::STSS:
+      case OpCode::STA: case OpCode::STM: case OpCode::INC: case OpCode::DEC:
+      case OpCode::CFLAGS: case OpCode::ENI: case OpCode::DSI:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+}
+
+void Analyzer::bound_loop(u16 header, u32 iterations) {
+  loopBounds[header] = iterations;
+  routines.clear();
+}
+
+RoutineBounds Analyzer::routine(u16 entry) {
+  if (auto found = routines.find(entry); found != routines.end())
+    return found->second;
+  if (!inProgress.insert(entry).second) {
+    RoutineBounds result;
+    result.error = AnalysisError::Recursion;
+    result.where = result.entry = entry;
+    return result;
+  }
+  auto result = analyze(entry);
+  inProgress.erase(entry);
+  routines[entry] = result;
+  return result;
+}
+
+RoutineBounds Analyzer::interrupt() {
+  auto result = routine(static_cast<u16>(memory[0xff][0xfe] << 8 | memory[0xff][0xff]));
+  if (result) {
+    result.cycles += interrupt_entry_cycles;
+    result.stack += 2; // cs and ip
+  }
+  return result;
+}
+
+std::optional<u32> Analyzer::stack_with_interrupts(u16 entry, u32 nesting) {
+  auto body = routine(entry);
+  auto handler = interrupt();
+  if (!body || !handler)
+    return std::nullopt;
+  // the handler can only be interrupted itself if it enables interrupts before its iret
+  auto levels = handler.enablesInterrupts ? nesting : std::min(nesting, 1u);
+  return body.stack + levels * handler.stack;
+}
+
+RoutineBounds Analyzer::analyze(u16 entry) {
+  RoutineBounds result;
+  result.entry = entry;
+  auto fail = [&](AnalysisError error, u16 where) {
+    result.error = error;
+    result.where = where;
+    return result;
+  };
+
+  // recover the graph, one instruction to a node, until what is known of the accumulator settles
+  std::vector<Node> nodes;
+  std::unordered_map<u16, u32> index;
+  std::vector<u32> work;
+  auto reach = [&](u16 addr, Accumulator a) {
+    auto [found, added] = index.try_emplace(addr, static_cast<u32>(nodes.size()));
+    if (added) {
+      nodes.emplace_back();
+      nodes.back().addr = addr;
+    }
+    if (nodes[found->second].a.merge(a))
+      work.push_back(found->second);
+    return found->second;
+  };
+  reach(entry, Accumulator{ true, false, 0 });
+
+  while (!work.empty()) {
+    auto n = work.back();
+    work.pop_back();
+    auto addr = nodes[n].addr;
+    auto a = nodes[n].a;
+
+    std::array<u8, 2> bytes{ memory[addr >> 8][addr & 0xff], 0 };
+    u32 next = addr + length_table[bytes[0]];
+    if (next == addr || next > 0xffff)
+      return fail(AnalysisError::InvalidInstruction, addr);
+    if (next - addr == 2)
+      bytes[1] = memory[(addr + 1) >> 8][(addr + 1) & 0xff];
+    auto insn = *Instruction::disassemble(bytes).instruction;
+    auto op = insn.opcode();
+    bool immediate = insn.has_immediate();
+    // ip has already moved past the instruction, perhaps into the next segment, when a jump sets it
+    auto near = [&] { return static_cast<u16>((next & 0xff00) | insn.immedidate()); };
+    auto far = [&] { return static_cast<u16>(a.value << 8 | insn.immedidate()); };
+
+    Accumulator after{ true, false, 0 };
+    if (keepsAccumulator(op))
+      after = a;
+    u64 cost = cycle_table[bytes[0]];
+    i32 push = 0;
+    u32 calleeStack = 0;
+    bool exit = false;
+    std::array<u32, 2> succ{ none, none };
+
+    switch (op) {
+      case OpCode::JN:
+        if (!immediate)
+          return fail(AnalysisError::IndirectJump, addr);
+        succ[0] = reach(near(), after);
+        break;
+      case OpCode::JF:
+        if (!immediate || !a.known)
+          return fail(AnalysisError::IndirectJump, addr);
+        succ[0] = reach(far(), after);
+        break;
+      case OpCode::Jc:
+        succ[0] = reach(static_cast<u16>(next), after);
+        succ[1] = reach(near(), after);
+        break;
+
+      case OpCode::CALLN:
+      case OpCode::CALLF:
+        {
+          if (!immediate || (op == OpCode::CALLF && !a.known))
+            return fail(AnalysisError::IndirectJump, addr);
+          auto callee = routine(op == OpCode::CALLN ? near() : far());
+          if (!callee)
+            return fail(callee.error, callee.where);
+          cost += callee.cycles;
+          calleeStack = callee.stack;
+          result.enablesInterrupts |= callee.enablesInterrupts;
+          succ[0] = reach(static_cast<u16>(next), after);
+        }
+        break;
+      case OpCode::RET:
+      case OpCode::IRET:
+      case OpCode::HLT:
+        exit = true;
+        break;
+
+      case OpCode::PUSH:
+      case OpCode::PUSH_CSR:
+        push = 1;
+        succ[0] = reach(static_cast<u16>(next), after);
+        break;
+      case OpCode::POP:
+      case OpCode::POP_CSR:
+        push = -1;
+        succ[0] = reach(static_cast<u16>(next), after);
+        break;
+
+      case OpCode::ENI:
+        result.enablesInterrupts = true;
+        succ[0] = reach(static_cast<u16>(next), after);
+        break;
+      case OpCode::LDA:
+        if (immediate)
+          after = Accumulator{ true, true, insn.immedidate() };
+        succ[0] = reach(static_cast<u16>(next), after);
+        break;
+      case OpCode::CLR:
+        after = Accumulator{ true, true, 0 };
+        succ[0] = reach(static_cast<u16>(next), after);
+        break;
+      default:
+        succ[0] = reach(static_cast<u16>(next), after);
+        break;
+    }
+
+    auto& node = nodes[n];
+    node.cost = cost;
+    node.push = push;
+    node.calleeStack = calleeStack;
+    node.succ = succ;
+    node.exit = exit;
+  }
+  auto count = nodes.size();
+
+  // every path to an instruction must have pushed the same amount, so that loops don't grow the stack
+  {
+    std::vector<i32> depth(count);
+    std::vector<bool> seen(count);
+    std::vector<u32> queue{ 0 };
+    seen[0] = true;
+    i64 highest = 0;
+    while (!queue.empty()) {
+      auto n = queue.back();
+      queue.pop_back();
+      auto const& node = nodes[n];
+      highest = std::max<i64>({ highest, depth[n] + node.push, i64(depth[n]) + node.calleeStack });
+      for (auto s : node.succ) {
+        if (s == none)
+          continue;
+        if (!seen[s]) {
+          seen[s] = true;
+          depth[s] = depth[n] + node.push;
+          queue.push_back(s);
+        } else if (depth[s] != depth[n] + node.push) {
+          return fail(AnalysisError::UnbalancedStack, nodes[s].addr);
+        }
+      }
+    }
+    result.stack = static_cast<u32>(highest);
+  }
+
+  // the order parts of the graph are reached in, from a start, following the edges a filter allows
+  std::vector<std::vector<u32>> succs(count);
+  std::vector<u32> rep(count);
+  std::vector<u32> visited(count);
+  u32 generation = 0;
+  auto reversePostorder = [&](u32 start, auto const& follow) {
+    std::vector<u32> order;
+    std::vector<std::pair<u32, std::size_t>> stack{ { start, 0 } };
+    visited[start] = ++generation;
+    while (!stack.empty()) {
+      auto [n, i] = stack.back();
+      if (i == succs[n].size()) {
+        order.push_back(n);
+        stack.pop_back();
+        continue;
+      }
+      stack.back().second++;
+      auto s = rep[succs[n][i]];
+      if (visited[s] != generation && follow(s)) {
+        visited[s] = generation;
+        stack.push_back({ s, 0 });
+      }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+  };
+
+  for (std::size_t n = 0; n < count; n++) {
+    for (auto s : nodes[n].succ) {
+      if (s != none)
+        succs[n].push_back(s);
+    }
+  }
+  std::iota(rep.begin(), rep.end(), 0u);
+
+  // find the loops from the dominator tree, by Cooper, Harvey and Kennedy's method
+  auto rpo = reversePostorder(0, [](u32) { return true; });
+  std::vector<u32> number(count);
+  for (std::size_t i = 0; i < rpo.size(); i++)
+    number[rpo[i]] = static_cast<u32>(i);
+  std::vector<std::vector<u32>> preds(count);
+  for (std::size_t n = 0; n < count; n++) {
+    for (auto s : succs[n])
+      preds[s].push_back(static_cast<u32>(n));
+  }
+  std::vector<u32> idom(count, none);
+  idom[0] = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto n : rpo) {
+      if (n == 0)
+        continue;
+      auto dom = none;
+      for (auto p : preds[n]) {
+        if (idom[p] == none)
+          continue;
+        if (dom == none) {
+          dom = p;
+          continue;
+        }
+        auto other = p;
+        while (dom != other) {
+          while (number[dom] > number[other])
+            dom = idom[dom];
+          while (number[other] > number[dom])
+            other = idom[other];
+        }
+      }
+      if (idom[n] != dom) {
+        idom[n] = dom;
+        changed = true;
+      }
+    }
+  }
+  auto dominates = [&](u32 h, u32 n) {
+    while (n != h && n != 0)
+      n = idom[n];
+    return n == h;
+  };
+
+  std::vector<Loop> loops;
+  std::unordered_map<u32, std::size_t> loopOf;
+  for (std::size_t n = 0; n < count; n++) {
+    for (auto h : succs[n]) {
+      if (number[h] > number[n])
+        continue;
+      if (!dominates(h, static_cast<u32>(n)))
+        return fail(AnalysisError::Irreducible, nodes[h].addr);
+      auto [found, added] = loopOf.try_emplace(h, loops.size());
+      if (added)
+        loops.push_back(Loop{ h, { h } });
+      loops[found->second].body.push_back(static_cast<u32>(n));
+    }
+  }
+  // a loop's body is everything which reaches one of its back edges without passing through its header
+  for (auto& loop : loops) {
+    if (!loopBounds.contains(nodes[loop.header].addr))
+      return fail(AnalysisError::UnboundedLoop, nodes[loop.header].addr);
+    ++generation;
+    std::vector<u32> pending;
+    std::vector<u32> body;
+    for (auto n : loop.body) {
+      if (visited[n] != generation) {
+        visited[n] = generation;
+        body.push_back(n);
+        if (n != loop.header)
+          pending.push_back(n);
+      }
+    }
+    while (!pending.empty()) {
+      auto n = pending.back();
+      pending.pop_back();
+      for (auto p : preds[n]) {
+        if (visited[p] != generation) {
+          visited[p] = generation;
+          body.push_back(p);
+          pending.push_back(p);
+        }
+      }
+    }
+    loop.body = std::move(body);
+  }
+
+  // collapse each loop into its header, inner ones first, which leaves the graph without cycles
+  std::sort(loops.begin(), loops.end(), [](Loop const& l, Loop const& r) { return l.body.size() < r.body.size(); });
+  std::vector<u64> cost(count), dist(count);
+  std::vector<bool> sink(count);
+  for (std::size_t n = 0; n < count; n++) {
+    cost[n] = nodes[n].cost;
+    sink[n] = nodes[n].exit;
+  }
+  std::vector<bool> member(count);
+  auto longest = [&](std::vector<u32> const& order) {
+    for (auto n : order)
+      dist[n] = 0;
+    dist[order[0]] = cost[order[0]];
+    for (auto n : order) {
+      for (auto s : succs[n]) {
+        auto t = rep[s];
+        if (visited[t] == generation && t != order[0])
+          dist[t] = std::max(dist[t], dist[n] + cost[t]);
+      }
+    }
+  };
+  for (auto const& loop : loops) {
+    auto h = loop.header;
+    for (auto n : loop.body)
+      member[n] = true;
+    auto order = reversePostorder(h, [&](u32 t) { return member[t] && t != h; });
+    longest(order);
+
+    u64 iteration = 0, exit = 0;
+    bool exits = false, ends = false;
+    std::vector<u32> outside;
+    for (auto n : order) {
+      bool leaves = sink[n];
+      ends |= sink[n];
+      for (auto s : succs[n]) {
+        if (rep[s] == h) {
+          iteration = std::max(iteration, dist[n]);
+        } else if (!member[rep[s]]) {
+          leaves = true;
+          outside.push_back(s);
+        }
+      }
+      if (leaves) {
+        exits = true;
+        exit = std::max(exit, dist[n]);
+      }
+    }
+    u64 bound = std::max(loopBounds[nodes[h].addr], 1u);
+    cost[h] = exits ? (bound - 1) * iteration + exit : bound * iteration;
+    sink[h] = ends || !exits;
+    succs[h] = std::move(outside);
+    for (auto n : loop.body) {
+      rep[n] = h;
+      member[n] = false;
+    }
+  }
+
+  auto order = reversePostorder(0, [](u32) { return true; });
+  longest(order);
+  for (auto n : order) {
+    if (sink[n])
+      result.cycles = std::max(result.cycles, dist[n]);
+  }
+  return result;
+}
@@ -1,5 +1,10 @@
 #include <daisa.hpp>
+#include <daisa/analysis.hpp>
+#include <daisa/assembler/object.hpp>
+#include <daisa/assembler/segment_cache.hpp>
+#include <daisa/assembler/stream.hpp>
 #include <iostream>
+#include <memory>
 
 #include <string>
 #include <array>
@@ -121,6 +126,369 @@ bool assemble_blocks_test() {
     return true;
 }
 
+bool cycle_table_test() {
+    using namespace daisa;
+
+    // immediate forms cost an extra fetch
+    if (Instruction::create(OpCode::LDA, Register::R1)->cycles() != opcode_base_cycles(OpCode::LDA)) return false;
+    if (Instruction::create(OpCode::LDA, (u8)1)->cycles() != opcode_base_cycles(OpCode::LDA) + immediate_fetch_cycles) return false;
+    if (Instruction::create(OpCode::Jc, Condition::Zero, 0)->cycles() != opcode_base_cycles(OpCode::Jc) + immediate_fetch_cycles) return false;
+
+    // the table must agree with the decoded instruction for every valid encoding
+    for (auto i = 0u; i < 256; i++) {
+        auto data = std::array<u8, 2>{ (u8)i, 0 };
+        auto result = Instruction::disassemble(data);
+        auto expect = result ? result.instruction->cycles() : 0;
+        if (cycle_table[i] != expect) return false;
+        if (result && expect == 0) return false;
+    }
+
+    static_assert(cycle_table[0b01010000] == 3); // ldm imm
+    static_assert(cycle_table[0b01010001] == 2); // ldm r1
+    static_assert(cycle_table[0b11111111] == 0); // invalid
+    static_assert(cycle_table[0b11010100] == 4); // mul
+    static_assert(opcode_is_extension(OpCode::MUL) && opcode_is_extension(OpCode::SUBW));
+    static_assert(!opcode_is_extension(OpCode::HCALL) && !opcode_is_extension(OpCode::LDA));
+
+    return true;
+}
+
+bool link_test() {
+    using namespace daisa;
+    using assembler::Label, assembler::LabelRef, assembler::ObjectBuilder, assembler::Object, assembler::Image,
+        assembler::LinkOptions, assembler::LinkError;
+    using Insn = assembler::Instruction;
+
+    // main calls helper in another object, which is fixed in segment 10
+    Label start{ "start", {} }, loop{ "loop", {} }, helper{ "helper", {} }, io{ "io", 0xe004 };
+    ObjectBuilder a;
+    a.section("main");
+    if (!a.define(start, true)) return false;
+    if (!a.emit(Insn(OpCode::LDA, (u8)3))) return false;
+    if (!a.define(loop)) return false;
+    if (!a.emit(Insn(OpCode::DEC_A))) return false;
+    if (!a.emit(Insn(OpCode::Jc, Condition::NotZero, LabelRef{ &loop, LabelRef::Low }))) return false;
+    if (!a.emit(Insn(OpCode::LDDS, LabelRef{ &io, LabelRef::High }))) return false;
+    if (!a.emit(Insn(OpCode::LDA, LabelRef{ &helper, LabelRef::High }))) return false;
+    if (!a.emit(Insn(OpCode::CALLF, LabelRef{ &helper, LabelRef::Low }))) return false;
+    if (!a.emit(Insn(OpCode::HLT))) return false;
+    if (a.define(loop)) return false; // already defined
+    auto main = a.finish();
+
+    Label helper2{ "helper", {} };
+    ObjectBuilder b;
+    b.section("lib", 0x10);
+    if (!b.emit(Insn(OpCode::NOP))) return false;
+    if (!b.define(helper2, true)) return false;
+    if (!b.emit(Insn(OpCode::RET))) return false;
+    auto lib = b.finish();
+
+    // objects survive a round trip through bytes, so they can be cached
+    auto bytes = main.serialize();
+    auto cached = Object::deserialize(bytes);
+    if (!cached || cached->serialize() != bytes) return false;
+    bytes.pop_back();
+    if (Object::deserialize(bytes)) return false;
+
+    std::array objects{ *cached, lib };
+    auto image = std::make_unique<Image>();
+    if (!assembler::link(objects, *image, LinkOptions{ .firstSegment = 2 })) return false;
+    auto const expect = std::array<u8, 13>{
+        Instruction::create(OpCode::LDA, (u8)0)->encode(), 3,
+        Instruction::create(OpCode::DEC_A)->encode(),
+        Instruction::create(OpCode::Jc, Condition::NotZero, 0)->encode(), 0x02,
+        Instruction::create(OpCode::LDDS, (u8)0)->encode(), 0xe0,
+        Instruction::create(OpCode::LDA, (u8)0)->encode(), 0x10,
+        Instruction::create(OpCode::CALLF, (u8)0)->encode(), 0x01,
+        Instruction::create(OpCode::HLT)->encode(),
+        0,
+    };
+    if (!std::equal(expect.begin(), expect.end(), image->segments[2].begin())) return false;
+    if (image->segments[0x10][1] != Instruction::create(OpCode::RET)->encode()) return false;
+    if (image->find("start") != 0x0200 || image->find("helper") != 0x1001 || image->find("loop")) return false;
+    if (!image->used[2] || !image->used[0x10] || image->used.count() != 2) return false;
+
+    // sections are packed in order, moving to the next segment when one doesn't fit
+    ObjectBuilder c;
+    for (auto i = 0; i < 3; i++) {
+        c.section("pad" + std::to_string(i));
+        for (auto j = 0; j < 100; j++)
+            c.emit(Insn(OpCode::NOP));
+    }
+    std::array padded{ c.finish() };
+    if (!assembler::link(padded, *image)) return false;
+    if (!image->used[0] || !image->used[1] || image->used.count() != 2) return false;
+
+    std::array missing{ main };
+    auto result = assembler::link(missing, *image);
+    if (result.error != LinkError::UndefinedSymbol || result.name != "helper") return false;
+    std::array twice{ main, lib, lib };
+    return assembler::link(twice, *image).error == LinkError::DuplicateSymbol;
+}
+
+bool segment_cache_test() {
+    using namespace daisa;
+    using assembler::Label, assembler::LabelRef, assembler::Item, assembler::SegmentCache;
+    using Insn = assembler::Instruction;
+
+    // a chain of functions, each loading the address of the next, spread over several segments
+    std::vector<Label> labels(100);
+    for (auto i = 0u; i < labels.size(); i++)
+        labels[i].name = "f" + std::to_string(i);
+    std::vector<Item> program;
+    for (auto i = 0u; i < labels.size(); i++) {
+        program.push_back(&labels[i]);
+        auto& next = labels[(i + 1) % labels.size()];
+        program.push_back(Insn(OpCode::LDA, LabelRef{ &next, LabelRef::High }));
+        program.push_back(Insn(OpCode::JF, LabelRef{ &next, LabelRef::Low }));
+        program.push_back(Insn(OpCode::INC, Register::R1));
+        program.push_back(Insn(OpCode::ADD, (u8)i));
+    }
+
+    // the same as assembling the resolved instructions in one go
+    auto matches = [&](SegmentCache const& cache) {
+        std::vector<Instruction> flat;
+        for (auto const& item : program) {
+            if (auto const* insn = std::get_if<Insn>(&item)) {
+                u8 byte = 0;
+                if (insn->has_label()) {
+                    auto addr = *insn->label().label->boundTo;
+                    byte = static_cast<u8>(insn->label().kind == LabelRef::High ? addr >> 8 : addr & 0xff);
+                }
+                flat.push_back(*insn->resolve(byte));
+            }
+        }
+        auto expect = assemble_all(flat);
+        if (expect.size() != cache.segments().size()) return false;
+        for (auto i = 0u; i < expect.size(); i++) {
+            if (expect[i] != cache.segments()[i]) return false;
+        }
+        return true;
+    };
+
+    SegmentCache cache;
+    auto changed = cache.assemble(program);
+    if (!changed || changed->count() != 3 || !matches(cache)) return false;
+    if (labels[1].boundTo != 7) return false;
+
+    // nothing changed
+    changed = cache.assemble(program);
+    if (!changed || changed->any()) return false;
+
+    // a literal in the middle of segment 1
+    program[5 * 50 + 4] = Insn(OpCode::ADD, (u8)0xaa);
+    changed = cache.assemble(program);
+    if (!changed || changed->count() != 1 || !(*changed)[1] || !matches(cache)) return false;
+
+    // moving the last function moves its label, which the one before it refers to from segment 2
+    program.insert(program.end() - 5, Insn(OpCode::NOP));
+    changed = cache.assemble(program);
+    if (!changed || changed->count() != 1 || !(*changed)[2] || !matches(cache)) return false;
+
+    // and moving the first one changes every segment after it, and the last function's reference to it
+    program.insert(program.begin(), Insn(OpCode::NOP));
+    changed = cache.assemble(program);
+    if (!changed || changed->count() != 3 || !matches(cache)) return false;
+
+    // a shorter program drops its last segment; the last function it keeps refers to the next, so that stays
+    program.erase(program.begin() + 5 * 5, program.end());
+    program.push_back(&labels[5]);
+    program.push_back(Insn(OpCode::HLT));
+    changed = cache.assemble(program);
+    if (!changed || !(*changed)[1] || !(*changed)[2] || cache.segments().size() != 1 || !matches(cache)) return false;
+
+    // the functions it dropped are unbound, so referring to one fails rather than using its old address
+    if (labels[99].boundTo || !labels[1].boundTo) return false;
+    program.push_back(Insn(OpCode::JF, LabelRef{ &labels[99], LabelRef::Low }));
+    if (cache.assemble(program)) return false;
+    program.pop_back();
+
+    Label nowhere{ "nowhere", {} };
+    std::array<Item, 1> unbound{ Insn(OpCode::JN, LabelRef{ &nowhere, LabelRef::Low }) };
+    return !cache.assemble(unbound) && cache.segments().empty();
+}
+
+bool stream_test() {
+    using namespace daisa;
+    using assembler::Label, assembler::LabelRef, assembler::InstructionStream, assembler::PackedInstruction;
+    using Insn = assembler::Instruction;
+
+    // the same chain of functions as segment_cache, referring to each label before it is defined
+    std::vector<Label> labels(100);
+    for (auto i = 0u; i < labels.size(); i++)
+        labels[i].name = "f" + std::to_string(i);
+    Label io{ "io", 0xe004 };
+    InstructionStream stream;
+    std::vector<Insn> source;
+    for (auto i = 0u; i < labels.size(); i++) {
+        if (!stream.define(*stream.label(labels[i].name))) return false;
+        auto& next = labels[(i + 1) % labels.size()];
+        for (auto const& insn : {
+            Insn(OpCode::LDA, LabelRef{ &next, LabelRef::High }),
+            Insn(OpCode::JF, LabelRef{ &next, LabelRef::Low }),
+            Insn(OpCode::LDDS, LabelRef{ &io, LabelRef::High }),
+            Insn(OpCode::ADD, (u8)i),
+        }) {
+            if (!stream.push(insn)) return false;
+            source.push_back(insn);
+        }
+    }
+    if (stream.size() != 400 || stream.label_count() != 100 || *stream.label("f7") != 7) return false;
+    if (stream.find("io") || stream.name(42) != "f42" || stream.define(7)) return false;
+
+    // each function is 8 bytes long, so the labels' addresses are known
+    auto assembled = stream.assemble();
+    if (!assembled || assembled->segments.size() != 4 || assembled->labels[99] != 99 * 8) return false;
+    for (auto& label : labels)
+        label.boundTo = assembled->labels[*stream.find(label.name)];
+    std::vector<Instruction> flat;
+    for (auto const& insn : source) {
+        u8 byte = 0;
+        if (insn.has_label()) {
+            auto addr = *insn.label().label->boundTo;
+            byte = static_cast<u8>(insn.label().kind == LabelRef::High ? addr >> 8 : addr & 0xff);
+        }
+        flat.push_back(*insn.resolve(byte));
+    }
+    if (assemble_all(flat) != assembled->segments) return false;
+
+    // the disassembly round-trips, with every immediate as a literal
+    std::vector<u8> bytes;
+    for (auto const& seg : assembled->segments)
+        bytes.insert(bytes.end(), seg.begin(), seg.end());
+    bytes.resize(100 * 8);
+    auto [decoded, reason] = InstructionStream::disassemble(bytes);
+    if (reason != FailureReason::NoData || decoded.size() != stream.size()) return false;
+    for (auto i = 0u; i < flat.size(); i++) {
+        if (decoded[i] != PackedInstruction::pack(flat[i]) || decoded[i].unpack().encode() != flat[i].encode()) return false;
+    }
+
+    // a pass dropping the data segment loads moves nothing but the addresses
+    auto removed = stream.remove_if([](PackedInstruction insn) { return insn.opcode() == OpCode::LDDS; });
+    assembled = stream.assemble();
+    if (removed != 100 || stream.size() != 300 || stream.definition(99) != 99 * 3) return false;
+    if (!assembled || assembled->segments.size() != 3 || assembled->labels[99] != 99 * 6) return false;
+
+    // a copy has its own table, so it still works once the stream it came from is gone
+    auto original = std::make_unique<InstructionStream>(stream);
+    InstructionStream copy(*original);
+    original.reset();
+    if (copy.find("f42") != 42u || *copy.label("f99") != 99 || copy.label_count() != 100) return false;
+    if (!copy.assemble() || copy.assemble()->segments != assembled->segments) return false;
+    original = std::make_unique<InstructionStream>();
+    *original = copy;
+    copy = InstructionStream();
+    if (original->find("f7") != 7u || copy.find("f7") || copy.label_count() != 0) return false;
+
+    // a reference to a label which isn't defined
+    auto jn = *Instruction::create(OpCode::JN, 0);
+    auto nowhere = *PackedInstruction::pack(jn, *stream.label("nowhere"), LabelRef::Low);
+    if (!stream.push(nowhere) || stream.assemble()) return false;
+
+    // packed words are checked: a label not in the table, a code which can't be decoded, an immediate with no
+    // operand, an operand with no immediate, and a literal which doesn't fit in a byte
+    u32 invalidCode = 0;
+    while (length_table[invalidCode] != 0)
+        invalidCode++;
+    for (auto bits : {
+        nowhere.bits() + (1u << 10),
+        invalidCode,
+        u32(jn.encode()),
+        PackedInstruction::pack(*Instruction::create(OpCode::HLT)).bits() | (1u << 8),
+        PackedInstruction::pack(jn).bits() | (1u << 18),
+    }) {
+        if (stream.push(PackedInstruction(bits))) return false;
+    }
+    return stream.size() == 301 && sizeof(PackedInstruction) == 4;
+}
+
+bool analysis_test() {
+    using namespace daisa;
+    using analysis::Analyzer, analysis::AnalysisError;
+
+    std::array<std::array<u8, 256>, 256> memory{};
+    auto put = [&](u16 addr, std::initializer_list<std::optional<Instruction>> insns) {
+        for (auto const& insn : insns) {
+            memory[addr >> 8][addr & 0xff] = insn->encode();
+            if (insn->has_immediate())
+                memory[(addr + 1) >> 8][(addr + 1) & 0xff] = insn->immedidate();
+            addr += insn->length();
+        }
+    };
+    // main counts down a, then calls a near routine with r1 pushed, and a far one which enables interrupts
+    put(0x0000, {
+        Instruction::create(OpCode::LDA, (u8)3),                   // 2
+        Instruction::create(OpCode::DEC_A),                        // 1, runs 3 times
+        Instruction::create(OpCode::Jc, Condition::NotZero, 0x02), // 3, runs 3 times
+        Instruction::create(OpCode::PUSH, Register::R1),           // 2
+        Instruction::create(OpCode::CALLN, (u8)0x20),              // 4
+        Instruction::create(OpCode::POP, Register::R1),            // 2
+        Instruction::create(OpCode::LDA, (u8)1),                   // 2
+        Instruction::create(OpCode::CALLF, (u8)0x00),              // 4
+        Instruction::create(OpCode::HLT),                          // 1
+    });
+    put(0x0020, {
+        Instruction::create(OpCode::PUSH, Register::R2),
+        Instruction::create(OpCode::PUSH, Register::R3),
+        Instruction::create(OpCode::POP, Register::R3),
+        Instruction::create(OpCode::POP, Register::R2),
+        Instruction::create(OpCode::RET),
+    });
+    put(0x0100, { Instruction::create(OpCode::ENI), Instruction::create(OpCode::RET) });
+    // the interrupt routine at 02:00 has a loop which leaves from the middle
+    memory[0xff][0xfe] = 0x02;
+    memory[0xff][0xff] = 0x00;
+    put(0x0200, {
+        Instruction::create(OpCode::PUSH, Register::R1),           // 2
+        Instruction::create(OpCode::LDA, (u8)4),                   // 2
+        Instruction::create(OpCode::SUB, (u8)1),                   // 2, runs 5 times
+        Instruction::create(OpCode::Jc, Condition::Zero, 0x09),    // 3, runs 5 times
+        Instruction::create(OpCode::JN, (u8)0x03),                 // 3, runs 4 times
+        Instruction::create(OpCode::POP, Register::R1),            // 2
+        Instruction::create(OpCode::IRET),                         // 3
+    });
+
+    Analyzer analyzer(memory);
+    auto main = analyzer.routine(0x0000);
+    if (main || main.error != AnalysisError::UnboundedLoop || main.where != 0x0002) return false;
+    analyzer.bound_loop(0x0002, 3);
+    analyzer.bound_loop(0x0203, 5);
+    main = analyzer.routine(0x0000);
+    if (!main || main.cycles != 2 + 3 * 4 + 2 + (4 + 10) + 2 + 2 + (4 + 3) + 1) return false;
+    if (main.stack != 3 || !main.enablesInterrupts) return false;
+    auto handler = analyzer.interrupt();
+    if (!handler || handler.entry != 0x0200 || handler.cycles != interrupt_entry_cycles + 2 + 2 + 5 * 5 + 4 * 3 + 2 + 3)
+        return false;
+    if (handler.stack != 3 || handler.enablesInterrupts) return false;
+    // the handler doesn't enable interrupts, so they can't nest
+    if (analyzer.stack_with_interrupts(0x0000, 4) != 6 || analyzer.stack_with_interrupts(0x0000, 0) != 3) return false;
+
+    // routines it can't bound
+    put(0x0300, { Instruction::create(OpCode::CALLN, (u8)0x00) });
+    put(0x0310, { Instruction::create(OpCode::JN, Register::R1) });
+    put(0x0320, {
+        Instruction::create(OpCode::Jc, Condition::Zero, 0x23),
+        Instruction::create(OpCode::PUSH, Register::R1),
+        Instruction::create(OpCode::RET),
+    });
+    put(0x0330, {
+        Instruction::create(OpCode::Jc, Condition::Zero, 0x34),
+        Instruction::create(OpCode::NOP),
+        Instruction::create(OpCode::NOP),
+        Instruction::create(OpCode::NOP),
+        Instruction::create(OpCode::JN, (u8)0x32),
+    });
+    put(0x0340, { Instruction::create(OpCode::LDA, Register::R1), Instruction::create(OpCode::CALLF, (u8)0x00) });
+    memory[0x03][0x50] = 0xff;
+    auto fails = [&](u16 entry, AnalysisError error, u16 where) {
+        auto result = analyzer.routine(entry);
+        return !result && result.error == error && result.where == where;
+    };
+    return fails(0x0300, AnalysisError::Recursion, 0x0300) && fails(0x0310, AnalysisError::IndirectJump, 0x0310)
+        && fails(0x0320, AnalysisError::UnbalancedStack, 0x0323) && fails(0x0330, AnalysisError::Irreducible, 0x0332)
+        && fails(0x0340, AnalysisError::IndirectJump, 0x0341) && fails(0x0350, AnalysisError::InvalidInstruction, 0x0350);
+}
+
 int main(int argc, char **argv) {
     if(argc != 2) {
         std::cout << argv[0] << " takes one argument.\n";
@@ -130,6 +498,16 @@ int main(int argc, char **argv) {
         return !instruction_test();
     if (std::string(argv[1]) == "assemble_blocks")
         return !assemble_blocks_test();
+    if (std::string(argv[1]) == "cycle_table")
+        return !cycle_table_test();
+    if (std::string(argv[1]) == "link")
+        return !link_test();
+    if (std::string(argv[1]) == "segment_cache")
+        return !segment_cache_test();
+    if (std::string(argv[1]) == "stream")
+        return !stream_test();
+    if (std::string(argv[1]) == "analysis")
+        return !analysis_test();
 
     std::cout << "Unrecognized test." << std::endl;
     return 0;
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <daisa/types.hpp>
+#include <daisa/instruction.hpp>
+
+namespace daisa::analysis {
+
+  /// @brief Memory as segments, such as assembler::Image::segments.
+  using Memory = std::span<std::array<u8, 256> const, 256>;
+
+  enum class AnalysisError {
+    None,
+    /// an instruction can't be decoded, or the routine runs off the end of memory
+    InvalidInstruction,
+    /// a jump or call goes to a register, or a far one's segment isn't known from an earlier lda
+    IndirectJump,
+    /// a loop has no bound given with bound_loop
+    UnboundedLoop,
+    /// a loop can be entered somewhere other than its header
+    Irreducible,
+    /// a routine calls itself, directly or not
+    Recursion,
+    /// two paths reach an instruction with different amounts pushed
+    UnbalancedStack,
+  };
+
+  /// @brief The worst case of a routine, from its entry to a ret, iret or hlt.
+  struct RoutineBounds {
+    AnalysisError error = AnalysisError::None;
+    /// the address the error is about
+    u16 where = 0;
+    u16 entry = 0;
+    u64 cycles = 0;
+    /// the most bytes on the stack above where it was on entry, including those its callees push
+    u32 stack = 0;
+    /// whether it, or a routine it calls, may run eni
+    bool enablesInterrupts = false;
+
+    [[nodiscard]] explicit operator bool() const noexcept { return error == AnalysisError::None; }
+  };
+
+  /// @brief Bounds the time and stack routines in an image take, without running them.
+  /// @note The control-flow graph is recovered by decoding from the entry. Jumps and calls must be to immediates,
+  ///   and a far one's segment is taken from an lda of an immediate on every path to it. A call is charged its
+  ///   callee's worst case, and returns to the instruction after it. Loops must be reducible, and each must have a
+  ///   bound; a loop with no way out is charged for that many iterations, then treated as the end of the routine.
+  ///   Writes to sp and ss other than by push and pop aren't followed.
+  class Analyzer {
+  public:
+    explicit Analyzer(Memory memory) noexcept : memory(memory) {}
+
+    /// @brief Sets the most times the loop with its header at an address runs its header each time it is entered.
+    void bound_loop(u16 header, u32 iterations);
+
+    /// @brief Analyzes the routine at an address, and those it calls.
+    [[nodiscard]] RoutineBounds routine(u16 entry);
+    /// @brief Analyzes the interrupt routine whose address is at ff:fe, counting the cycles and the two bytes
+    ///   pushed to enter it.
+    [[nodiscard]] RoutineBounds interrupt();
+
+    /// @brief The deepest the stack gets while running a routine, if interrupts are taken on top of it.
+    /// @param nesting  The most interrupts which may be active at once, if the interrupt routine enables them.
+    /// @return The number of bytes, or nothing if either routine can't be analyzed.
+    [[nodiscard]] std::optional<u32> stack_with_interrupts(u16 entry, u32 nesting = 1);
+
+  private:
+    Memory memory;
+    std::unordered_map<u16, u32> loopBounds;
+    std::unordered_map<u16, RoutineBounds> routines;
+    std::unordered_set<u16> inProgress;
+
+    RoutineBounds analyze(u16 entry);
+  };
+
+}
@@ -97,6 +97,11 @@ namespace daisa::assembler {
     [[nodiscard]] constexpr Instruction with_argument(LabelRef label) const noexcept;
     [[nodiscard]] constexpr Instruction with_argument(Condition cond, LabelRef label) const noexcept;
 
+    /// @brief Gets the machine instruction, with a label's byte given explicitly.
+    /// @param[in]  labelByte  The immediate to use in place of a label, if it has one.
+    /// @return                The instruction, or nothing if this one isn't valid.
+    [[nodiscard]] constexpr std::optional<BaseInstruction> resolve(u8 labelByte = 0) const noexcept;
+
   };
 
   // implementation
@@ -149,4 +154,16 @@ namespace daisa::assembler {
     return Instruction(opcode(), cond, label);
   }
 
+  constexpr std::optional<BaseInstruction> Instruction::resolve(u8 labelByte) const noexcept {
+    if (!is_valid())
+      return std::nullopt;
+    if (!has_argument())
+      return BaseInstruction::create(opcode());
+    if (has_condition())
+      return BaseInstruction::create(opcode(), condition_arg(), labelByte);
+    if (has_immediate())
+      return BaseInstruction::create(opcode(), has_literal() ? literal() : labelByte);
+    return BaseInstruction::create(opcode(), register_arg());
+  }
+
 }
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <daisa/types.hpp>
+#include <daisa/assembler/instruction.hpp>
+
+namespace daisa::assembler {
+
+  /// @brief A reference to a symbol from an immediate byte, filled in by the linker.
+  struct Relocation {
+    /// the offset of the immediate in its section
+    u8 offset;
+    /// the index of the symbol in the object
+    u32 symbol;
+    decltype(LabelRef::kind) kind;
+  };
+
+  /// @brief A run of code which is placed in one segment as a whole.
+  struct Section {
+    std::string name;
+    /// at most 256 bytes
+    std::vector<u8> code;
+    std::vector<Relocation> relocations;
+    /// if set, the section must be placed in this segment
+    std::optional<u8> segment;
+  };
+
+  struct Symbol {
+    std::string name;
+    /// the index of the section which defines it, or nothing if another object does
+    std::optional<u32> section;
+    u8 offset = 0;
+    /// whether other objects can refer to it; references between objects are only by name
+    bool global = false;
+  };
+
+  /// @brief A module assembled on its own, whose references to labels are left for the linker.
+  /// @note An object depends only on its own source, so it can be cached as bytes with serialize.
+  struct Object {
+    std::vector<Section> sections;
+    std::vector<Symbol> symbols;
+
+    [[nodiscard]] std::vector<u8> serialize() const;
+    /// @return The object, or nothing if the bytes are not one.
+    [[nodiscard]] static std::optional<Object> deserialize(std::span<u8 const> bytes);
+  };
+
+  /// @brief Assembles a module into an Object, one section at a time.
+  /// @note A label is a symbol of the object it is defined in. Referring to a label which is neither defined in the
+  ///   object nor bound to an address makes it an undefined symbol, found among the other objects' global symbols
+  ///   by name when linking.
+  class ObjectBuilder {
+  public:
+    /// @brief Starts a new section; everything emitted afterwards goes into it.
+    void section(std::string name, std::optional<u8> segment = std::nullopt);
+    /// @brief Defines a label at the next instruction in the section.
+    /// @return Whether it could be defined: it must not have been already, and there must be a section.
+    bool define(Label& label, bool global = false);
+    /// @brief Adds an instruction to the section.
+    /// @return Whether it could be added: it must be valid, and fit in the section.
+    bool emit(Instruction const& insn);
+
+    /// @brief Finishes the object, leaving the builder empty.
+    [[nodiscard]] Object finish();
+
+  private:
+    Object object;
+    std::unordered_map<Label const*, u32> symbols;
+
+    u32 symbolFor(Label const& label);
+  };
+
+  /// @brief A linked program, laid out as memory is.
+  struct Image {
+    std::array<std::array<u8, 256>, 256> segments{};
+    /// the segments with a section in them
+    std::bitset<256> used;
+    /// the address of each global symbol
+    std::unordered_map<std::string, u16> symbols;
+
+    [[nodiscard]] std::optional<u16> find(std::string_view name) const;
+  };
+
+  enum class LinkError {
+    None,
+    /// a symbol is referred to, but no object defines it as global
+    UndefinedSymbol,
+    /// two objects define the same global symbol
+    DuplicateSymbol,
+    /// a section is larger than a segment
+    SectionTooLarge,
+    /// a section doesn't fit in the segment it must be placed in
+    SegmentFull,
+    /// the sections don't fit in memory
+    OutOfMemory,
+    /// a relocation is outside its section, or names a symbol which doesn't exist
+    BadRelocation,
+  };
+
+  struct LinkResult {
+    LinkError error = LinkError::None;
+    /// the name of the symbol or section the error is about
+    std::string name;
+
+    [[nodiscard]] explicit operator bool() const noexcept { return error == LinkError::None; }
+  };
+
+  struct LinkOptions {
+    /// the first segment sections without a fixed one are placed in
+    u8 firstSegment = 0;
+  };
+
+  /// @brief Places every section into a segment, resolves the symbols, and writes the result into an image.
+  /// @note Sections with a fixed segment are placed first, and the rest are packed in order from
+  ///   LinkOptions::firstSegment into the first space after the last one placed. Takes time linear in the total
+  ///   size of the objects.
+  /// @param[out]  image  Where the program is written; left unspecified if linking fails.
+  LinkResult link(std::span<Object const> objects, Image& image, LinkOptions const& options = {});
+
+}
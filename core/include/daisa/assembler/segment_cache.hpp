@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <optional>
+#include <span>
+#include <variant>
+#include <vector>
+
+#include <daisa/types.hpp>
+#include <daisa/assembler/instruction.hpp>
+
+namespace daisa::assembler {
+
+  /// @brief One element of a program: an instruction, or the definition of a label at the next one.
+  using Item = std::variant<Instruction, Label*>;
+
+  /// @brief Assembles a whole program, laid out from address 0 as the assemble_segment chain lays it out, keeping
+  ///   each segment's output so that assembling an edited program only encodes the segments which changed.
+  /// @note A segment is reused when a hash of the instructions that overlap it, with the addresses of the labels
+  ///   they refer to, is the same as last time; so moving a label re-emits every segment which refers to it.
+  ///   Laying out and hashing the program still looks at every item, but they cost much less than encoding.
+  ///   The hash is a 64-bit FNV-1a, and the instructions aren't compared, so reuse is probabilistic: a collision
+  ///   (with odds around 2^-64 per segment) would keep the old machine code. Call clear before an assemble whose
+  ///   output must be exact.
+  class SegmentCache {
+  public:
+    /// @brief Assembles a program, binding each label it defines to its address. Labels which it refers to but
+    ///   doesn't define must already be bound. Labels the last call bound are unbound first, so they must still
+    ///   exist, and a program can't refer to one it no longer defines.
+    /// @return The segments which were assembled again, including any which the program no longer reaches, or
+    ///   nothing if an instruction isn't valid, refers to a label which isn't bound, or the program doesn't fit
+    ///   in memory. The cache is left empty if it fails.
+    std::optional<std::bitset<256>> assemble(std::span<Item const> program);
+
+    /// @brief The output of the last successful assemble, one array per segment the program reaches.
+    [[nodiscard]] std::span<std::array<u8, 256> const> segments() const noexcept { return output; }
+
+    /// @brief Forgets every segment, so that the next assemble encodes all of them, and unbinds the labels the
+    ///   last assemble bound.
+    void clear() noexcept;
+
+  private:
+    std::vector<std::array<u8, 256>> output;
+    std::vector<u64> keys;
+    /// the labels the last assemble defined
+    std::vector<Label*> bound;
+    // scratch space for the layout, kept so that it isn't reallocated each time
+    std::vector<u32> addresses;
+    std::vector<std::size_t> firstItems;
+  };
+
+}
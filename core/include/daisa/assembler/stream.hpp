@@ -0,0 +1,185 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <daisa/types.hpp>
+#include <daisa/instruction.hpp>
+#include <daisa/assembler/instruction.hpp>
+
+namespace daisa::assembler {
+
+  /// @brief The index of a label in an InstructionStream's table.
+  using LabelId = u32;
+
+  /// @brief An instruction in 32 bits: its first encoded byte, what its immediate is, and the literal or label.
+  class PackedInstruction {
+  public:
+    enum class Operand : u8 {
+      None = 0,
+      Literal = 1,
+      /// the low byte of a label's address
+      Low = 2,
+      /// the high byte of a label's address
+      High = 3,
+    };
+
+    /// label ids must fit in the 22 bits left
+    static constexpr u32 max_labels = 1u << 22;
+
+    constexpr explicit PackedInstruction(u32 bits) noexcept : bits_(bits) {}
+
+    /// @brief Packs a machine instruction, whose immediate, if it has one, is a literal.
+    [[nodiscard]] static constexpr PackedInstruction pack(BaseInstruction const& insn) noexcept {
+      return insn.has_immediate()
+        ? PackedInstruction(insn.encode(), Operand::Literal, insn.immedidate())
+        : PackedInstruction(insn.encode(), Operand::None, 0);
+    }
+    /// @brief Packs a machine instruction whose immediate is a byte of a label's address.
+    /// @return The instruction, or nothing if it has no immediate or the label id doesn't fit.
+    [[nodiscard]] static constexpr std::optional<PackedInstruction> pack(
+      BaseInstruction const& insn, LabelId label, decltype(LabelRef::kind) kind) noexcept {
+      if (!insn.has_immediate() || label >= max_labels)
+        return std::nullopt;
+      return PackedInstruction(insn.encode(), kind == LabelRef::High ? Operand::High : Operand::Low, label);
+    }
+
+    [[nodiscard]] constexpr u32 bits() const noexcept { return bits_; }
+    /// the first encoded byte, which decides the opcode, the argument, and whether an immediate follows
+    [[nodiscard]] constexpr u8 code() const noexcept { return static_cast<u8>(bits_ & 0xff); }
+    [[nodiscard]] constexpr OpCode opcode() const noexcept { return unpack().opcode(); }
+    [[nodiscard]] constexpr u8 length() const noexcept { return length_table[code()]; }
+    [[nodiscard]] constexpr Operand operand() const noexcept { return static_cast<Operand>((bits_ >> 8) & 0b11); }
+    [[nodiscard]] constexpr bool has_label() const noexcept { return operand() >= Operand::Low; }
+    [[nodiscard]] constexpr u8 literal() const noexcept { return static_cast<u8>(bits_ >> 10); }
+    [[nodiscard]] constexpr LabelId label() const noexcept { return bits_ >> 10; }
+    /// @brief Whether the code can be decoded and has an operand exactly when it has an immediate. Without one the
+    ///   other bits must be 0, and a literal must fit in a byte.
+    [[nodiscard]] constexpr bool is_valid() const noexcept {
+      if (length() == 0 || (operand() == Operand::None) != (length() == 1))
+        return false;
+      if (operand() == Operand::None)
+        return bits_ >> 10 == 0;
+      return operand() != Operand::Literal || bits_ >> 18 == 0;
+    }
+
+    /// @brief Gets the machine instruction, with a label's byte given explicitly.
+    [[nodiscard]] constexpr BaseInstruction unpack(u8 labelByte = 0) const noexcept {
+      auto data = std::array<u8, 2>{ code(), has_label() ? labelByte : literal() };
+      return *BaseInstruction::disassemble(data).instruction;
+    }
+
+    constexpr bool operator==(PackedInstruction const&) const noexcept = default;
+
+  private:
+    u32 bits_;
+
+    constexpr PackedInstruction(u8 code, Operand operand, u32 value) noexcept
+      : bits_(code | (static_cast<u32>(operand) << 8) | (value << 10))
+    {}
+  };
+
+  static_assert(sizeof(PackedInstruction) == 4);
+
+  /// @brief The result of assembling an InstructionStream.
+  struct AssembledStream {
+    /// laid out from address 0, one array per segment
+    std::vector<std::array<u8, 256>> segments;
+    /// the address of each label, indexed by its id; 0 for those which aren't defined
+    std::vector<u16> labels;
+  };
+
+  /// @brief A long run of instructions, stored as contiguous arrays for tool passes to walk.
+  /// @note Each instruction is a PackedInstruction, so a pass which only looks at opcodes reads 4 bytes per
+  ///   instruction, rather than the 32 an assembler::Instruction takes. Labels are interned by name into a table,
+  ///   with their names and the instruction each is defined at in arrays of their own.
+  class InstructionStream {
+  public:
+    /// the definition of a label which hasn't been defined
+    static constexpr u32 undefined = ~u32(0);
+
+    InstructionStream() = default;
+    // the index refers to the strings in names, so a copy has to build its own
+    InstructionStream(InstructionStream const& other);
+    InstructionStream& operator=(InstructionStream const& other);
+    InstructionStream(InstructionStream&&) noexcept = default;
+    InstructionStream& operator=(InstructionStream&&) noexcept = default;
+
+    /// @brief Gets the id of the label with a name, adding it to the table if it isn't there.
+    /// @return The id, or nothing if the table is full.
+    std::optional<LabelId> label(std::string_view name);
+    /// @brief Gets the id of the label with a name, if it is in the table.
+    [[nodiscard]] std::optional<LabelId> find(std::string_view name) const;
+    [[nodiscard]] std::string_view name(LabelId label) const noexcept { return names[label]; }
+    /// @brief The index of the instruction a label is defined at, or undefined; it may be one past the last.
+    [[nodiscard]] u32 definition(LabelId label) const noexcept { return definitions[label]; }
+    [[nodiscard]] std::size_t label_count() const noexcept { return names.size(); }
+
+    /// @brief Defines a label at the next instruction.
+    /// @return Whether it could be defined: it must not have been already.
+    bool define(LabelId label);
+
+    /// @brief Adds an instruction which is already packed.
+    /// @return Whether it could be added: it must be valid, and any label it refers to must be in the table.
+    bool push(PackedInstruction insn);
+    /// @brief Adds an instruction, interning the label it refers to, if any, by its name.
+    /// @return Whether it could be added: it must be valid.
+    bool push(Instruction const& insn);
+
+    [[nodiscard]] std::size_t size() const noexcept { return words_.size(); }
+    [[nodiscard]] PackedInstruction operator[](std::size_t i) const noexcept { return words_[i]; }
+    /// @brief The instructions, for passes which rewrite them in place; each must be left as push would accept it.
+    [[nodiscard]] std::span<PackedInstruction> words() noexcept { return words_; }
+    [[nodiscard]] std::span<PackedInstruction const> words() const noexcept { return words_; }
+
+    /// @brief Removes the instructions a predicate is true for, moving labels defined at one to the next kept.
+    /// @return The number removed.
+    template <typename Pred>
+    std::size_t remove_if(Pred pred);
+
+    /// @brief Lays the stream out from address 0, and encodes it.
+    /// @return The result, or nothing if an instruction refers to a label which isn't defined, or the stream
+    ///   doesn't fit in memory.
+    [[nodiscard]] std::optional<AssembledStream> assemble() const;
+
+    /// @brief Decodes instructions until the data ends or one can't be decoded; immediates become literals.
+    /// @return The stream, and the reason it stopped, which is FailureReason::NoData if it reached the end.
+    [[nodiscard]] static std::pair<InstructionStream, FailureReason> disassemble(std::span<u8 const> data);
+
+  private:
+    std::vector<PackedInstruction> words_;
+    std::vector<u32> definitions;
+    // a deque, so that the views the index holds stay valid as it grows
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, LabelId> index;
+  };
+
+  // implementation
+
+  template <typename Pred>
+  std::size_t InstructionStream::remove_if(Pred pred) {
+    // where each instruction ends up, with removed ones mapped to the next that is kept
+    std::vector<u32> moved(words_.size() + 1);
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < words_.size(); i++) {
+      moved[i] = static_cast<u32>(kept);
+      if (!pred(words_[i]))
+        words_[kept++] = words_[i];
+    }
+    moved[words_.size()] = static_cast<u32>(kept);
+    auto removed = words_.size() - kept;
+    words_.erase(words_.begin() + static_cast<std::ptrdiff_t>(kept), words_.end());
+    for (auto& def : definitions) {
+      if (def != undefined)
+        def = moved[def];
+    }
+    return removed;
+  }
+
+}
@@ -30,8 +30,8 @@ namespace daisa {
   }
 
   enum class OpCode : u8 {
-    #define INSN_NARG(name, bits) name = detail::noarg_op(bits),
-    #define INSN_ARG_(name, bits, kind) name = detail::arg_op(bits, kind),
+    #define INSN_NARG(name, bits, cycles) name = detail::noarg_op(bits),
+    #define INSN_ARG_(name, bits, kind, cycles) name = detail::arg_op(bits, kind),
     #define KIND_IMMREG ArgKind::ImmReg
     #define KIND_REG ArgKind::RegOnly
     #define KIND_COND ArgKind::Cond
@@ -86,6 +86,41 @@ namespace daisa {
     return kind;
   }
 
+  /// @brief Gets whether an opcode is in the extended arithmetic set, which a machine only executes if it enables it.
+  /// @param[in]  opcode  The opcode to check.
+  /// @return             Whether the opcode is an extension.
+  [[nodiscard]] inline constexpr bool opcode_is_extension(OpCode opcode) noexcept {
+    #define INSN_ARG_(name, bits, kind, cycles)
+    #define INSN_NARG(name, bits, cycles)
+    #define INSN_XNARG(name, bits, cycles) case OpCode::name: return true;
+    switch (opcode) {
+      #include <daisa/isa.inc>
+    default: return false;
+    }
+    #undef INSN_XNARG
+    #undef INSN_NARG
+    #undef INSN_ARG_
+    return false;
+  }
+
+  /// @brief The number of extra cycles taken to fetch an instruction's immediate.
+  inline constexpr u8 immediate_fetch_cycles = 1;
+  /// @brief The number of cycles taken to enter an interrupt routine (two pushes and the vector load).
+  inline constexpr u8 interrupt_entry_cycles = 4;
+
+  /// @brief Gets the number of cycles an opcode takes to execute, not counting the fetch of an immediate.
+  /// @param[in]  opcode  The opcode to get the cost of.
+  /// @return             The base cost of the opcode, or 0 if it is not valid.
+  [[nodiscard]] inline constexpr u8 opcode_base_cycles(OpCode opcode) noexcept {
+    #define INSN_CYCLES(name, cycles) case OpCode::name: return cycles;
+    switch (opcode) {
+      #include <daisa/isa.inc>
+    default: return 0;
+    }
+    #undef INSN_CYCLES
+    return 0;
+  }
+
   enum class Register : u8 {
     Imm = 0b000,
     R1 = 0b001,
@@ -164,6 +199,10 @@ namespace daisa {
     [[nodiscard]] constexpr Register reg_argument() const noexcept { return arg.reg; }
     [[nodiscard]] constexpr Condition cond_argument() const noexcept { return arg.cond; }
 
+    [[nodiscard]] constexpr u8 cycles() const noexcept {
+      return opcode_base_cycles(opcode_) + (hasImm ? immediate_fetch_cycles : 0);
+    }
+
     [[nodiscard]] constexpr u8 encode() const noexcept;
     [[nodiscard]] static constexpr DisassemblyResult disassemble(std::span<u8 const> const&) noexcept;
   };
@@ -312,6 +351,32 @@ namespace daisa {
     #undef INSN_ARG
   }
 
+  namespace detail {
+    constexpr std::array<u8, 256> make_cycle_table() noexcept {
+      std::array<u8, 256> table{};
+      for (auto i = 0u; i < table.size(); i++) {
+        auto data = std::array<u8, 2>{ static_cast<u8>(i), 0 };
+        auto result = Instruction::disassemble(data);
+        table[i] = result ? result.instruction->cycles() : 0;
+      }
+      return table;
+    }
+    constexpr std::array<u8, 256> make_length_table() noexcept {
+      std::array<u8, 256> table{};
+      for (auto i = 0u; i < table.size(); i++) {
+        auto data = std::array<u8, 2>{ static_cast<u8>(i), 0 };
+        auto result = Instruction::disassemble(data);
+        table[i] = result ? result.instruction->length() : 0;
+      }
+      return table;
+    }
+  }
+
+  /// @brief The cost in cycles of each instruction, indexed by its first encoded byte. Invalid encodings cost 0.
+  inline constexpr std::array<u8, 256> cycle_table = detail::make_cycle_table();
+  /// @brief The length in bytes of each instruction, indexed by its first encoded byte. Invalid encodings are 0 long.
+  inline constexpr std::array<u8, 256> length_table = detail::make_length_table();
+
 
   struct AssembleResult {
     std::array<u8, 256> output;
@@ -368,7 +433,7 @@ namespace daisa {
   }
 
   constexpr AssembleResult assemble_segment(AssembleResult const& lastResult) noexcept {
-    AssembleResult result; // make sure this NVRO's
+    AssembleResult result{}; // make sure this NVRO's
     detail::assemble_segment(lastResult, result);
     return result;
   }
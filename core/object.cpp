@@ -0,0 +1,303 @@
+#include <daisa/assembler/object.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+using namespace daisa;
+using namespace daisa::assembler;
+
+namespace {
+
+  constexpr std::array<u8, 4> object_magic{ 'D', 'A', 'O', 1 };
+
+  struct Writer {
+    std::vector<u8> out;
+
+    void byte(u8 v) { out.push_back(v); }
+    void word(u32 v) {
+      for (auto i = 0; i < 4; i++)
+        out.push_back(static_cast<u8>(v >> (8 * i)));
+    }
+    void bytes(std::span<u8 const> v) {
+      word(static_cast<u32>(v.size()));
+      out.insert(out.end(), v.begin(), v.end());
+    }
+    void string(std::string const& v) {
+      bytes(std::span{ reinterpret_cast<u8 const*>(v.data()), v.size() });
+    }
+  };
+
+  struct Reader {
+    std::span<u8 const> in;
+    bool ok = true;
+
+    u8 byte() {
+      if (in.empty()) {
+        ok = false;
+        return 0;
+      }
+      auto v = in[0];
+      in = in.subspan(1);
+      return v;
+    }
+    u32 word() {
+      u32 v = 0;
+      for (auto i = 0; i < 4; i++)
+        v |= static_cast<u32>(byte()) << (8 * i);
+      return v;
+    }
+    std::span<u8 const> bytes() {
+      auto size = word();
+      if (!ok || size > in.size()) {
+        ok = false;
+        return {};
+      }
+      auto v = in.first(size);
+      in = in.subspan(size);
+      return v;
+    }
+    std::string string() {
+      auto v = bytes();
+      return std::string(reinterpret_cast<char const*>(v.data()), v.size());
+    }
+  };
+
+}
+
+std::vector<u8> Object::serialize() const {
+  Writer w;
+  w.out.insert(w.out.end(), object_magic.begin(), object_magic.end());
+  w.word(static_cast<u32>(sections.size()));
+  for (auto const& section : sections) {
+    w.string(section.name);
+    w.byte(section.segment.has_value());
+    w.byte(section.segment.value_or(0));
+    w.bytes(section.code);
+    w.word(static_cast<u32>(section.relocations.size()));
+    for (auto const& reloc : section.relocations) {
+      w.byte(reloc.offset);
+      w.word(reloc.symbol);
+      w.byte(reloc.kind == LabelRef::High);
+    }
+  }
+  w.word(static_cast<u32>(symbols.size()));
+  for (auto const& symbol : symbols) {
+    w.string(symbol.name);
+    w.byte(symbol.section.has_value());
+    w.word(symbol.section.value_or(0));
+    w.byte(symbol.offset);
+    w.byte(symbol.global);
+  }
+  return std::move(w.out);
+}
+
+std::optional<Object> Object::deserialize(std::span<u8 const> bytes) {
+  if (bytes.size() < object_magic.size() || !std::equal(object_magic.begin(), object_magic.end(), bytes.begin()))
+    return std::nullopt;
+  Reader r{ bytes.subspan(object_magic.size()) };
+  Object object;
+
+  // counts are checked against what is left, so that a corrupt one can't make us allocate much
+  auto count = [&](std::size_t minSize) {
+    auto n = r.word();
+    if (n > r.in.size() / minSize)
+      r.ok = false;
+    return r.ok ? n : 0;
+  };
+  auto sectionCount = count(14);
+  object.sections.resize(sectionCount);
+  for (auto& section : object.sections) {
+    section.name = r.string();
+    bool fixed = r.byte() != 0;
+    auto segment = r.byte();
+    if (fixed)
+      section.segment = segment;
+    auto code = r.bytes();
+    section.code.assign(code.begin(), code.end());
+    auto relocCount = count(6);
+    section.relocations.resize(relocCount);
+    for (auto& reloc : section.relocations) {
+      reloc.offset = r.byte();
+      reloc.symbol = r.word();
+      reloc.kind = r.byte() != 0 ? LabelRef::High : LabelRef::Low;
+    }
+    if (!r.ok)
+      return std::nullopt;
+  }
+  auto symbolCount = count(11);
+  object.symbols.resize(symbolCount);
+  for (auto& symbol : object.symbols) {
+    symbol.name = r.string();
+    bool defined = r.byte() != 0;
+    auto section = r.word();
+    if (defined)
+      symbol.section = section;
+    symbol.offset = r.byte();
+    symbol.global = r.byte() != 0;
+  }
+  if (!r.ok || !r.in.empty())
+    return std::nullopt;
+  return object;
+}
+
+void ObjectBuilder::section(std::string name, std::optional<u8> segment) {
+  object.sections.push_back(Section{ std::move(name), {}, {}, segment });
+}
+
+u32 ObjectBuilder::symbolFor(Label const& label) {
+  auto [it, added] = symbols.try_emplace(&label, static_cast<u32>(object.symbols.size()));
+  if (added)
+    object.symbols.push_back(Symbol{ label.name, std::nullopt, 0, false });
+  return it->second;
+}
+
+bool ObjectBuilder::define(Label& label, bool global) {
+  if (object.sections.empty() || object.sections.back().code.size() >= 256)
+    return false;
+  auto& symbol = object.symbols[symbolFor(label)];
+  if (symbol.section)
+    return false;
+  symbol.section = static_cast<u32>(object.sections.size() - 1);
+  symbol.offset = static_cast<u8>(object.sections.back().code.size());
+  symbol.global = global;
+  return true;
+}
+
+bool ObjectBuilder::emit(Instruction const& insn) {
+  if (object.sections.empty())
+    return false;
+  auto& section = object.sections.back();
+
+  auto base = insn.resolve();
+  if (!base || section.code.size() + base->length() > 256)
+    return false;
+
+  section.code.push_back(base->encode());
+  if (!insn.has_immediate())
+    return true;
+  if (insn.has_literal()) {
+    section.code.push_back(insn.literal());
+    return true;
+  }
+
+  // a label bound to an address needs no linking
+  auto ref = insn.label();
+  if (ref.label->boundTo) {
+    auto addr = *ref.label->boundTo;
+    section.code.push_back(static_cast<u8>(ref.kind == LabelRef::High ? addr >> 8 : addr & 0xff));
+    return true;
+  }
+  section.relocations.push_back(Relocation{ static_cast<u8>(section.code.size()), symbolFor(*ref.label), ref.kind });
+  section.code.push_back(0);
+  return true;
+}
+
+Object ObjectBuilder::finish() {
+  symbols.clear();
+  return std::exchange(object, Object{});
+}
+
+std::optional<u16> Image::find(std::string_view name) const {
+  if (auto it = symbols.find(std::string(name)); it != symbols.end())
+    return it->second;
+  return std::nullopt;
+}
+
+LinkResult daisa::assembler::link(std::span<Object const> objects, Image& image, LinkOptions const& options) {
+  image.segments = {};
+  image.used.reset();
+  image.symbols.clear();
+
+  // the address of each section, placing the fixed ones first
+  std::array<unsigned, 256> fill{};
+  std::vector<std::vector<u16>> bases(objects.size());
+  for (auto i = 0u; i < objects.size(); i++) {
+    bases[i].resize(objects[i].sections.size());
+    for (auto j = 0u; j < objects[i].sections.size(); j++) {
+      auto const& section = objects[i].sections[j];
+      if (section.code.size() > 256)
+        return { LinkError::SectionTooLarge, section.name };
+      if (!section.segment)
+        continue;
+      auto seg = *section.segment;
+      if (fill[seg] + section.code.size() > 256)
+        return { LinkError::SegmentFull, section.name };
+      bases[i][j] = static_cast<u16>((seg << 8) | fill[seg]);
+      fill[seg] += static_cast<unsigned>(section.code.size());
+      image.used[seg] = true;
+    }
+  }
+  unsigned seg = options.firstSegment;
+  for (auto i = 0u; i < objects.size(); i++) {
+    for (auto j = 0u; j < objects[i].sections.size(); j++) {
+      auto const& section = objects[i].sections[j];
+      if (section.segment)
+        continue;
+      while (seg < 256 && fill[seg] + section.code.size() > 256)
+        seg++;
+      if (seg == 256)
+        return { LinkError::OutOfMemory, section.name };
+      bases[i][j] = static_cast<u16>((seg << 8) | fill[seg]);
+      fill[seg] += static_cast<unsigned>(section.code.size());
+      image.used[seg] = true;
+    }
+  }
+
+  // then every global symbol into one table, so that each reference is found with a single lookup
+  std::size_t globalCount = 0;
+  for (auto const& object : objects)
+    globalCount += std::count_if(object.symbols.begin(), object.symbols.end(), [](auto const& s) { return s.global; });
+  std::unordered_map<std::string_view, u16> globals;
+  globals.reserve(globalCount);
+  auto address = [&](std::size_t i, Symbol const& symbol) {
+    return static_cast<u16>(bases[i][*symbol.section] + symbol.offset);
+  };
+  for (auto i = 0u; i < objects.size(); i++) {
+    for (auto const& symbol : objects[i].symbols) {
+      if (!symbol.global || !symbol.section)
+        continue;
+      if (*symbol.section >= objects[i].sections.size())
+        return { LinkError::BadRelocation, symbol.name };
+      if (!globals.try_emplace(symbol.name, address(i, symbol)).second)
+        return { LinkError::DuplicateSymbol, symbol.name };
+    }
+  }
+
+  std::vector<u16> resolved;
+  for (auto i = 0u; i < objects.size(); i++) {
+    auto const& object = objects[i];
+    resolved.resize(object.symbols.size());
+    for (auto s = 0u; s < object.symbols.size(); s++) {
+      auto const& symbol = object.symbols[s];
+      if (symbol.section) {
+        if (*symbol.section >= object.sections.size())
+          return { LinkError::BadRelocation, symbol.name };
+        resolved[s] = address(i, symbol);
+      } else if (auto it = globals.find(symbol.name); it != globals.end()) {
+        resolved[s] = it->second;
+      } else {
+        return { LinkError::UndefinedSymbol, symbol.name };
+      }
+    }
+
+    for (auto j = 0u; j < object.sections.size(); j++) {
+      auto const& section = object.sections[j];
+      auto base = bases[i][j];
+      auto* out = &image.segments[base >> 8][base & 0xff];
+      if (!section.code.empty())
+        std::memcpy(out, section.code.data(), section.code.size());
+      for (auto const& reloc : section.relocations) {
+        if (reloc.offset >= section.code.size() || reloc.symbol >= resolved.size())
+          return { LinkError::BadRelocation, section.name };
+        auto addr = resolved[reloc.symbol];
+        out[reloc.offset] = static_cast<u8>(reloc.kind == LabelRef::High ? addr >> 8 : addr & 0xff);
+      }
+    }
+  }
+
+  image.symbols.reserve(globals.size());
+  for (auto const& [name, addr] : globals)
+    image.symbols.emplace(std::string(name), addr);
+  return {};
+}
@@ -0,0 +1,125 @@
+#include <daisa/assembler/segment_cache.hpp>
+
+#include <algorithm>
+
+using namespace daisa;
+using namespace daisa::assembler;
+
+namespace {
+
+  // FNV-1a, fed a field at a time
+  struct Hash {
+    u64 value = 0xcbf29ce484222325;
+
+    void add(u64 v) {
+      for (auto i = 0; i < 8; i++) {
+        value ^= (v >> (8 * i)) & 0xff;
+        value *= 0x100000001b3;
+      }
+    }
+  };
+
+  u8 labelByte(LabelRef ref) {
+    auto addr = *ref.label->boundTo;
+    return static_cast<u8>(ref.kind == LabelRef::High ? addr >> 8 : addr & 0xff);
+  }
+
+}
+
+void SegmentCache::clear() noexcept {
+  output.clear();
+  keys.clear();
+  for (auto* label : bound)
+    label->boundTo.reset();
+  bound.clear();
+}
+
+std::optional<std::bitset<256>> SegmentCache::assemble(std::span<Item const> program) {
+  // labels the program no longer defines mustn't keep their old addresses
+  for (auto* label : bound)
+    label->boundTo.reset();
+  bound.clear();
+
+  // lay the program out, noting the first item which overlaps each segment
+  addresses.resize(program.size());
+  firstItems.clear();
+  u32 addr = 0;
+  for (std::size_t i = 0; i < program.size(); i++) {
+    addresses[i] = addr;
+    if (auto const* label = std::get_if<Label*>(&program[i])) {
+      (*label)->boundTo = static_cast<u16>(addr);
+      bound.push_back(*label);
+      continue;
+    }
+    auto const& insn = std::get<Instruction>(program[i]);
+    if (!insn.is_valid()) {
+      clear();
+      return std::nullopt;
+    }
+    addr += insn.has_immediate() ? 2 : 1;
+    while (firstItems.size() < (addr + 255) / 256)
+      firstItems.push_back(i);
+  }
+  if (addr > 256 * 256) {
+    clear();
+    return std::nullopt;
+  }
+
+  auto count = firstItems.size();
+  auto cached = std::min(count, output.size());
+  std::bitset<256> changed;
+  for (auto seg = count; seg < output.size(); seg++)
+    changed[seg] = true;
+  output.resize(count);
+  keys.resize(count);
+
+  for (std::size_t seg = 0; seg < count; seg++) {
+    u32 base = static_cast<u32>(seg * 256);
+    // the items which overlap the segment, including one which started in the last
+    auto begin = firstItems[seg];
+    auto end = begin;
+    while (end < program.size() && addresses[end] < base + 256)
+      end++;
+
+    Hash hash;
+    hash.add(addresses[begin] - base + 1); // the first may start in the segment before
+    for (auto i = begin; i < end; i++) {
+      auto const* insn = std::get_if<Instruction>(&program[i]);
+      if (!insn)
+        continue;
+      hash.add(static_cast<u8>(insn->opcode()));
+      hash.add(insn->has_register() ? static_cast<u8>(insn->register_arg())
+        : insn->has_condition() ? static_cast<u8>(insn->condition_arg()) : 0xff);
+      if (insn->has_literal()) {
+        hash.add(insn->literal());
+      } else if (insn->has_label()) {
+        if (!insn->label().label->boundTo) {
+          clear();
+          return std::nullopt;
+        }
+        hash.add(0x100 | labelByte(insn->label()));
+      }
+    }
+    if (seg < cached && keys[seg] == hash.value)
+      continue;
+
+    // only the changed segments are encoded again
+    auto& out = output[seg];
+    out = {};
+    for (auto i = begin; i < end; i++) {
+      auto const* insn = std::get_if<Instruction>(&program[i]);
+      if (!insn)
+        continue;
+      auto machine = *insn->resolve(insn->has_label() ? labelByte(insn->label()) : 0);
+      std::array<u8, 2> bytes{ machine.encode(), machine.has_immediate() ? machine.immedidate() : u8(0) };
+      for (u32 b = 0; b < machine.length(); b++) {
+        auto at = addresses[i] + b;
+        if (at >= base && at < base + 256)
+          out[at - base] = bytes[b];
+      }
+    }
+    keys[seg] = hash.value;
+    changed[seg] = true;
+  }
+  return changed;
+}
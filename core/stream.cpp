@@ -0,0 +1,120 @@
+#include <daisa/assembler/stream.hpp>
+
+using namespace daisa;
+using namespace daisa::assembler;
+
+InstructionStream::InstructionStream(InstructionStream const& other)
+  : words_(other.words_), definitions(other.definitions), names(other.names) {
+  for (std::size_t id = 0; id < names.size(); id++)
+    index.emplace(names[id], static_cast<LabelId>(id));
+}
+
+InstructionStream& InstructionStream::operator=(InstructionStream const& other) {
+  if (this != &other)
+    *this = InstructionStream(other);
+  return *this;
+}
+
+std::optional<LabelId> InstructionStream::label(std::string_view name) {
+  if (auto found = index.find(name); found != index.end())
+    return found->second;
+  if (names.size() >= PackedInstruction::max_labels)
+    return std::nullopt;
+  auto id = static_cast<LabelId>(names.size());
+  index.emplace(names.emplace_back(name), id);
+  definitions.push_back(undefined);
+  return id;
+}
+
+std::optional<LabelId> InstructionStream::find(std::string_view name) const {
+  if (auto found = index.find(name); found != index.end())
+    return found->second;
+  return std::nullopt;
+}
+
+bool InstructionStream::define(LabelId label) {
+  if (label >= definitions.size() || definitions[label] != undefined)
+    return false;
+  definitions[label] = static_cast<u32>(words_.size());
+  return true;
+}
+
+bool InstructionStream::push(PackedInstruction insn) {
+  if (!insn.is_valid() || (insn.has_label() && insn.label() >= definitions.size()))
+    return false;
+  words_.push_back(insn);
+  return true;
+}
+
+bool InstructionStream::push(Instruction const& insn) {
+  if (!insn.is_valid())
+    return false;
+  if (!insn.has_label()) {
+    words_.push_back(PackedInstruction::pack(*insn.resolve()));
+    return true;
+  }
+  auto ref = insn.label();
+  if (ref.label->boundTo) { // it is outside the stream, so its byte is already known
+    auto addr = *ref.label->boundTo;
+    words_.push_back(PackedInstruction::pack(
+      *insn.resolve(static_cast<u8>(ref.kind == LabelRef::High ? addr >> 8 : addr & 0xff))));
+    return true;
+  }
+  auto id = label(ref.label->name);
+  if (!id)
+    return false;
+  words_.push_back(*PackedInstruction::pack(*insn.resolve(), *id, ref.kind));
+  return true;
+}
+
+std::optional<AssembledStream> InstructionStream::assemble() const {
+  AssembledStream result;
+
+  // lay it out first, since a label may be referred to before it is defined
+  std::vector<u32> addresses(words_.size() + 1);
+  u32 addr = 0;
+  for (std::size_t i = 0; i < words_.size(); i++) {
+    addresses[i] = addr;
+    addr += words_[i].length();
+  }
+  addresses[words_.size()] = addr;
+  if (addr > 256 * 256)
+    return std::nullopt;
+
+  result.labels.resize(definitions.size());
+  for (std::size_t l = 0; l < definitions.size(); l++) {
+    if (definitions[l] != undefined)
+      result.labels[l] = static_cast<u16>(addresses[definitions[l]]);
+  }
+
+  result.segments.resize((addr + 255) / 256);
+  for (std::size_t i = 0; i < words_.size(); i++) {
+    auto word = words_[i];
+    auto at = addresses[i];
+    result.segments[at / 256][at % 256] = word.code();
+    if (word.operand() == PackedInstruction::Operand::None)
+      continue;
+    u8 immediate = word.literal();
+    if (word.has_label()) {
+      if (definitions[word.label()] == undefined)
+        return std::nullopt;
+      auto target = result.labels[word.label()];
+      immediate = static_cast<u8>(word.operand() == PackedInstruction::Operand::High ? target >> 8 : target & 0xff);
+    }
+    at++;
+    result.segments[at / 256][at % 256] = immediate;
+  }
+  return result;
+}
+
+std::pair<InstructionStream, FailureReason> InstructionStream::disassemble(std::span<u8 const> data) {
+  InstructionStream stream;
+  stream.words_.reserve(data.size() / 2);
+  while (true) {
+    auto result = BaseInstruction::disassemble(data);
+    if (!result)
+      return { std::move(stream), result.reason };
+    stream.words_.push_back(PackedInstruction::pack(*result.instruction));
+    data = result.continueFrom;
+  }
+}
@@ -0,0 +1,86 @@
+#include "banks.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <sys/mman.h>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+Banks::Banks(Memory& mem, u8 control, std::size_t bankCount)
+  : mem(mem), control(control), bankCount(bankCount), mapped(256), owners(bankCount) {
+  if (control == 0xff)
+    throw std::invalid_argument("Banks control pages must both fit in memory");
+  if (bankCount < 256 || bankCount > max_banks)
+    throw std::invalid_argument("Banks must have between 256 and max_banks banks");
+
+  // reserved lazily, so that only the banks actually used take memory
+  storeSize = bankCount * 256;
+  auto* addr = ::mmap(nullptr, storeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED)
+    throw std::system_error(errno, std::generic_category(), "could not reserve the bank store");
+  store = static_cast<u8*>(addr);
+
+  mmio[control] = true;
+  for (auto seg = 0u; seg < 256; seg++) {
+    mapped[seg] = static_cast<u16>(seg);
+    owners[seg] = static_cast<u8>(seg);
+    writeRegister(mem, static_cast<u8>(seg));
+  }
+}
+
+Banks::~Banks() {
+  ::munmap(store, storeSize);
+}
+
+void Banks::writeRegister(Memory& mem, u8 seg) {
+  mem.paged[control][seg] = static_cast<u8>(mapped[seg] & 0xff);
+  mem.paged[control + 1][seg] = static_cast<u8>(mapped[seg] >> 8);
+}
+
+bool Banks::map(u8 seg, u16 bank, PageMask* changed) {
+  return map(mem, seg, bank, changed);
+}
+
+bool Banks::map(Memory& mem, u8 seg, u16 bank, PageMask* changed) {
+  auto fail = [&] {
+    writeRegister(mem, seg);
+    if (changed) {
+      (*changed)[control] = true;
+      (*changed)[control + 1] = true;
+    }
+    return false;
+  };
+  if (bank == mapped[seg])
+    return true;
+  if (seg == control || seg == control + 1 || bank >= bankCount || owners[bank])
+    return fail();
+
+  auto old = mapped[seg];
+  std::memcpy(slot(old), mem.paged[seg].data(), 256);
+  std::memcpy(mem.paged[seg].data(), slot(bank), 256);
+  owners[old].reset();
+  owners[bank] = seg;
+  mapped[seg] = bank;
+  writeRegister(mem, seg);
+  if (changed)
+    (*changed)[seg] = true;
+  return true;
+}
+
+void Banks::operator()(Memory& mem, u16 addr, u8, PageMask& changed) {
+  if ((addr >> 8) != control)
+    return;
+  auto seg = static_cast<u8>(addr & 0xff);
+  auto bank = static_cast<u16>((mem.paged[control + 1][seg] << 8) | mem.paged[control][seg]);
+  map(mem, seg, bank, &changed);
+}
+
+std::span<u8, 256> Banks::contents(u16 bank) noexcept {
+  if (auto seg = owners[bank])
+    return mem.paged[*seg];
+  return std::span<u8, 256>(slot(bank), 256);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Extends memory with a large backing store of 256-byte banks, any of which the guest can map into a
+  ///   segment by writing its number to that segment's bank register.
+  /// @note The bank registers are in two control pages: the low byte of segment n's bank is at control:n, and the
+  ///   high byte at (control + 1):n. Writing the high byte only latches it; writing the low byte switches the bank.
+  ///   A bank mapped into a segment lives in memory itself, and switching copies it out and the new one in, so
+  ///   addressing is unchanged and costs nothing extra. A switch which names a bank past the end of the store or
+  ///   one mapped into another segment, or which would move one of the control pages, is ignored, and the
+  ///   register goes back to the bank currently mapped. Not thread-safe.
+  ///
+  ///   The backing store, and which bank each segment holds, are kept here rather than in Memory, so neither
+  ///   checkpoints nor History capture them: restoring one brings back the mapped segments, but unmapped banks keep
+  ///   their current contents, and the registers in the control pages may name banks other than those mapped.
+  class Banks {
+  public:
+    /// 16 MiB of banks, which is all that a 16-bit bank register can address
+    static constexpr std::size_t max_banks = 1 << 16;
+
+    /// @brief Maps each segment of mem to the bank with the same number, and sets up the control pages.
+    /// @param[in]  control    The first of the two control pages, which may not be the last page of memory.
+    /// @param[in]  bankCount  The number of banks in the backing store, which starts zeroed.
+    /// @throws std::invalid_argument if the control pages or the number of banks are out of range.
+    /// @throws std::system_error if the backing store cannot be reserved.
+    Banks(Memory& mem, u8 control, std::size_t bankCount = max_banks);
+    ~Banks();
+
+    Banks(Banks const&) = delete;
+    Banks& operator=(Banks const&) = delete;
+
+    /// @brief The pages for Options::mmioPages: just the low bytes, since writing the high ones does nothing.
+    [[nodiscard]] PageMask const& pages() const noexcept { return mmio; }
+    /// @brief Handles a store to the control page, for Callbacks::mmioWrite. mem must be the memory the banks
+    ///   were created with.
+    void operator()(Memory& mem, u16 addr, u8 value, PageMask& changed);
+
+    /// @brief The bank mapped into a segment.
+    [[nodiscard]] u16 bank(u8 seg) const noexcept { return mapped[seg]; }
+    /// @brief Maps a bank into a segment, as writing its bank register does.
+    /// @param[out]  changed  If set, the pages changed are marked in it.
+    /// @return Whether the bank could be mapped there.
+    bool map(u8 seg, u16 bank, PageMask* changed = nullptr);
+    /// @brief The contents of a bank, which are in memory while it is mapped. The bank must be in the store.
+    [[nodiscard]] std::span<u8, 256> contents(u16 bank) noexcept;
+
+  private:
+    Memory& mem;
+    u8 control;
+    std::size_t bankCount;
+    u8* store = nullptr;
+    std::size_t storeSize = 0;
+    PageMask mmio;
+    std::vector<u16> mapped;
+    /// the segment each bank is mapped into, if any
+    std::vector<std::optional<u8>> owners;
+
+    [[nodiscard]] u8* slot(u16 bank) const noexcept { return store + static_cast<std::size_t>(bank) * 256; }
+    void writeRegister(Memory& mem, u8 seg);
+    bool map(Memory& mem, u8 seg, u16 bank, PageMask* changed);
+  };
+
+}
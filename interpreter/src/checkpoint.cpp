@@ -0,0 +1,245 @@
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <span>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+// A checkpoint file is a header, followed by records which are each a full CPU state, a mask of the pages
+//   included, and then those pages in order. The first record holds every page. All values are little-endian.
+
+namespace {
+
+  constexpr std::array<u8, 8> file_magic{ 'd', 'a', 'i', 's', 'a', 'c', 'k', 'p' };
+  constexpr u32 file_version = 1;
+  constexpr std::size_t file_header_size = 16;
+
+  constexpr std::size_t cpu_state_size = 32;
+  constexpr std::size_t page_mask_size = 32;
+  constexpr std::size_t record_header_size = 8 + cpu_state_size + page_mask_size;
+  constexpr std::size_t page_size = 256;
+
+  enum class RecordKind : u8 {
+    Base = 0,
+    Delta = 1,
+  };
+
+  void putLE(u8* out, u64 value, std::size_t bytes) {
+    for (auto i = 0u; i < bytes; i++)
+      out[i] = static_cast<u8>(value >> (8 * i));
+  }
+
+  u64 getLE(u8 const* in, std::size_t bytes) {
+    u64 value = 0;
+    for (auto i = 0u; i < bytes; i++)
+      value |= static_cast<u64>(in[i]) << (8 * i);
+    return value;
+  }
+
+  // flags are written bit by bit, since the layout of the bitfield is up to the compiler
+  void putCpuState(u8* out, CpuState const& state) {
+    auto const& regs = state.registers;
+    auto const& flags = regs.flags;
+    u8 const fields[] = {
+      regs.a, regs.cs, regs.ds, regs.ss, regs.ip, regs.csr,
+      static_cast<u8>(flags.z | flags.c << 1 | flags.o << 2 | flags.n << 3),
+      regs.named.r1, regs.named.r2, regs.named.r3, regs.named.r4,
+      regs.named.lr, regs.named.sp, regs.named.bp,
+      state.intEnabled, state.halted,
+    };
+    std::memcpy(out, fields, sizeof(fields));
+    putLE(out + 16, state.cycles, 8);
+    putLE(out + 24, state.retired, 8);
+  }
+
+  CpuState getCpuState(u8 const* in) {
+    CpuState state;
+    auto& regs = state.registers;
+    regs.a = in[0];
+    regs.cs = in[1];
+    regs.ds = in[2];
+    regs.ss = in[3];
+    regs.ip = in[4];
+    regs.csr = in[5];
+    regs.flags.z = (in[6] & 0b0001) != 0;
+    regs.flags.c = (in[6] & 0b0010) != 0;
+    regs.flags.o = (in[6] & 0b0100) != 0;
+    regs.flags.n = (in[6] & 0b1000) != 0;
+    regs.named.r1 = in[7];
+    regs.named.r2 = in[8];
+    regs.named.r3 = in[9];
+    regs.named.r4 = in[10];
+    regs.named.lr = in[11];
+    regs.named.sp = in[12];
+    regs.named.bp = in[13];
+    state.intEnabled = in[14] != 0;
+    state.halted = in[15] != 0;
+    state.cycles = getLE(in + 16, 8);
+    state.retired = getLE(in + 24, 8);
+    return state;
+  }
+
+  bool writeAll(int fd, std::span<u8 const> data) {
+    while (!data.empty()) {
+      auto written = ::write(fd, data.data(), data.size());
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      data = data.subspan(static_cast<std::size_t>(written));
+    }
+    return true;
+  }
+
+}
+
+CheckpointWriter::CheckpointWriter(std::string const& path) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw std::system_error(errno, std::generic_category(), "could not open checkpoint file " + path);
+
+  std::vector<u8> header(file_header_size);
+  std::copy(file_magic.begin(), file_magic.end(), header.begin());
+  putLE(&header[8], file_version, 4);
+  queue.push_back(std::move(header));
+
+  writer = std::thread([this] { writeRecords(); });
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  {
+    std::lock_guard guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  writer.join();
+  ::close(fd);
+}
+
+void CheckpointWriter::checkpoint(Memory const& mem, CpuState const& state, PageMask& dirtyPages) {
+  auto kind = RecordKind::Delta;
+  if (!wroteBase) {
+    kind = RecordKind::Base;
+    dirtyPages.set();
+    wroteBase = true;
+  }
+
+  std::vector<u8> record(record_header_size + dirtyPages.count() * page_size);
+  record[0] = static_cast<u8>(kind);
+  putLE(&record[4], dirtyPages.count(), 4);
+  putCpuState(&record[8], state);
+  auto* mask = &record[8 + cpu_state_size];
+  auto* out = &record[record_header_size];
+  for (auto page = 0u; page < mem.paged.size(); page++) {
+    if (!dirtyPages[page])
+      continue;
+    mask[page / 8] |= static_cast<u8>(1 << (page % 8));
+    std::memcpy(out, mem.paged[page].data(), page_size);
+    out += page_size;
+  }
+  dirtyPages.reset();
+
+  {
+    std::lock_guard guard(lock);
+    queue.push_back(std::move(record));
+  }
+  wake.notify_all();
+}
+
+bool CheckpointWriter::flush() {
+  std::unique_lock guard(lock);
+  drained.wait(guard, [&] { return queue.empty() && !writing; });
+  return !failed;
+}
+
+void CheckpointWriter::writeRecords() {
+  std::unique_lock guard(lock);
+  while (true) {
+    wake.wait(guard, [&] { return stopping || !queue.empty(); });
+    if (queue.empty()) {
+      // only reached when stopping with nothing left to write
+      return;
+    }
+
+    auto record = std::move(queue.front());
+    queue.pop_front();
+    writing = true;
+    guard.unlock();
+
+    // a record only counts once it's on the disk, so that restoring never sees a later one without an earlier one
+    bool ok = writeAll(fd, record) && ::fdatasync(fd) == 0;
+
+    guard.lock();
+    writing = false;
+    failed = failed || !ok;
+    if (queue.empty())
+      drained.notify_all();
+  }
+}
+
+bool daisa::interpreter::restoreCheckpoint(std::string const& path, Memory& mem, CpuState& state) {
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < file_header_size) {
+    ::close(fd);
+    return false;
+  }
+  auto size = static_cast<std::size_t>(info.st_size);
+  auto* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  std::span file{ static_cast<u8 const*>(mapping), size };
+
+  // find the complete records first, so that nothing is changed if there are none
+  std::vector<std::size_t> records;
+  if (std::equal(file_magic.begin(), file_magic.end(), file.begin()) && getLE(&file[8], 4) == file_version) {
+    for (auto at = file_header_size; file.size() - at >= record_header_size;) {
+      auto kind = static_cast<RecordKind>(file[at]);
+      auto pages = getLE(&file[at + 4], 4);
+      if (pages > 256 || (kind != RecordKind::Base && kind != RecordKind::Delta)
+        || (kind == RecordKind::Base) != records.empty())
+        break;
+      auto length = record_header_size + pages * page_size;
+      if (file.size() - at < length)
+        break;
+      auto const* mask = &file[at + 8 + cpu_state_size];
+      std::size_t masked = 0;
+      for (auto i = 0u; i < page_mask_size; i++)
+        masked += std::popcount(mask[i]);
+      if (masked != pages)
+        break;
+      records.push_back(at);
+      at += length;
+    }
+  }
+
+  for (auto at : records) {
+    auto const* mask = &file[at + 8 + cpu_state_size];
+    auto const* in = &file[at + record_header_size];
+    for (auto page = 0u; page < mem.paged.size(); page++) {
+      if ((mask[page / 8] & (1 << (page % 8))) == 0)
+        continue;
+      std::memcpy(mem.paged[page].data(), in, page_size);
+      in += page_size;
+    }
+  }
+  if (!records.empty())
+    state = getCpuState(&file[records.back() + 8]);
+
+  ::munmap(mapping, size);
+  return !records.empty();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Appends checkpoints of a machine to a file from a background thread. The first checkpoint is a full
+  ///   image of memory, and each later one only holds the pages written since the one before, plus the CPU state.
+  /// @note Page writes are tracked through Options::dirtyPages, so the same mask must be passed to every call of
+  ///   interpret between checkpoints. Anything else that writes to memory must mark the pages it touches.
+  class CheckpointWriter {
+  public:
+    /// @brief Creates or truncates the checkpoint file.
+    /// @throws std::system_error if the file cannot be opened.
+    explicit CheckpointWriter(std::string const& path);
+    ~CheckpointWriter();
+
+    CheckpointWriter(CheckpointWriter const&) = delete;
+    CheckpointWriter& operator=(CheckpointWriter const&) = delete;
+
+    /// @brief Copies the state and the dirty pages, clears the mask, and queues them to be written.
+    ///   Returns as soon as the copy is made, so the machine may keep running.
+    void checkpoint(Memory const& mem, CpuState const& state, PageMask& dirtyPages);
+
+    /// @brief Waits for every queued checkpoint to reach the disk.
+    /// @return Whether every checkpoint so far was written successfully.
+    bool flush();
+
+  private:
+    int fd = -1;
+    bool wroteBase = false;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::deque<std::vector<u8>> queue;
+    bool writing = false;
+    bool stopping = false;
+    bool failed = false;
+    std::thread writer;
+
+    void writeRecords();
+  };
+
+  /// @brief Restores the latest complete checkpoint from a file written by CheckpointWriter, by mapping it
+  ///   and replaying the records in order. A record cut short by a crash while writing is ignored.
+  /// @return Whether the file held at least one complete checkpoint; if not, mem and state are unchanged.
+  bool restoreCheckpoint(std::string const& path, Memory& mem, CpuState& state);
+
+}
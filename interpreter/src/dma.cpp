@@ -0,0 +1,72 @@
+#include "dma.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+Dma::Dma(u16 base) : base(base) {
+  if ((base & 0xff) > 0x100 - register_count)
+    throw std::invalid_argument("Dma registers must not cross a page boundary");
+  mmio[base >> 8] = true;
+}
+
+bool Dma::takeInterrupt() noexcept {
+  return std::exchange(pending, false);
+}
+
+void Dma::operator()(Memory& mem, u16 addr, u8 value, PageMask& changed) {
+  if (addr != base + command_reg || value == 0)
+    return;
+  auto* regs = &mem.direct[base];
+  auto address = [&](u8 reg) { return static_cast<std::size_t>((regs[reg] << 8) | regs[reg + 1]); };
+  auto source = address(source_reg);
+  auto destination = address(destination_reg);
+  std::size_t length = static_cast<std::size_t>(regs[length_reg] | (regs[length_reg + 1] << 8));
+
+  // like hcall buffers, a transfer may cross segments, but is cut short at the end of memory
+  constexpr std::size_t end = 256*256;
+  auto mode = static_cast<Mode>(value & ~interrupt_when_done);
+  auto status = Status::Done;
+  switch (mode) {
+    case Mode::Copy:
+      length = std::min({ length, end - source, end - destination });
+      std::memmove(&mem.direct[destination], &mem.direct[source], length);
+      break;
+    case Mode::Fill:
+      length = std::min(length, end - destination);
+      std::memset(&mem.direct[destination], regs[source_reg], length);
+      break;
+    case Mode::Compare: {
+      length = std::min({ length, end - source, end - destination });
+      auto* first = &mem.direct[source];
+      auto [diff, _] = std::mismatch(first, first + length, &mem.direct[destination]);
+      if (diff != first + length)
+        status = Status::Mismatch;
+      length = static_cast<std::size_t>(diff - first);
+      break;
+    }
+    default:
+      status = Status::BadCommand;
+      length = 0;
+      break;
+  }
+
+  if (length != 0 && (mode == Mode::Copy || mode == Mode::Fill)) {
+    for (auto page = destination >> 8; page <= (destination + length - 1) >> 8; page++)
+      changed[page] = true;
+  }
+
+  // the length is replaced by the number of bytes transferred, or which matched
+  regs[command_reg] = 0;
+  regs[length_reg] = static_cast<u8>(length & 0xff);
+  regs[length_reg + 1] = static_cast<u8>(length >> 8);
+  regs[status_reg] = static_cast<u8>(status);
+  changed[base >> 8] = true;
+  if (value & interrupt_when_done)
+    pending = true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.hpp"
+
+namespace daisa::interpreter {
+
+  /// @brief A block transfer device, which copies, fills or compares memory on the host when the guest writes a
+  ///   command to its registers, and can raise an interrupt when done.
+  /// @note The registers are 8 bytes at a base address chosen by the host: the command, the source segment and
+  ///   offset, the destination segment and offset, the length (little-endian) and the status. Transfers happen
+  ///   as soon as the command is written, and take no cycles. Not thread-safe.
+  class Dma {
+  public:
+    /// the low bits of the command register
+    enum class Mode : u8 {
+      /// copies the source to the destination, as if through a temporary buffer if they overlap
+      Copy = 1,
+      /// fills the destination with the source segment register's value
+      Fill = 2,
+      /// compares the source with the destination
+      Compare = 3,
+    };
+    /// set in the command to raise an interrupt once it is done
+    static constexpr u8 interrupt_when_done = 0x80;
+
+    enum class Status : u8 {
+      Done = 0,
+      /// a compare found a difference
+      Mismatch = 1,
+      /// the command was not a valid mode
+      BadCommand = 2,
+    };
+
+    /// offsets of the registers from the base
+    static constexpr u8 command_reg = 0;
+    static constexpr u8 source_reg = 1;
+    static constexpr u8 destination_reg = 3;
+    static constexpr u8 length_reg = 5;
+    static constexpr u8 status_reg = 7;
+    static constexpr u8 register_count = 8;
+
+    /// @throws std::invalid_argument if the registers would cross a page boundary.
+    explicit Dma(u16 base);
+
+    /// @brief The pages for Options::mmioPages.
+    [[nodiscard]] PageMask const& pages() const noexcept { return mmio; }
+    /// @brief Handles a store to the registers, for Callbacks::mmioWrite; only writing the command does anything.
+    void operator()(Memory& mem, u16 addr, u8 value, PageMask& changed);
+
+    /// @brief Whether a completion interrupt is waiting to be taken, for Callbacks::nextInterrupt.
+    [[nodiscard]] bool interruptPending() const noexcept { return pending; }
+    /// @brief Takes the completion interrupt if one is waiting, for Callbacks::pollInterrupt.
+    [[nodiscard]] bool takeInterrupt() noexcept;
+
+  private:
+    u16 base;
+    PageMask mmio;
+    bool pending = false;
+  };
+
+}
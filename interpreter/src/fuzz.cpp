@@ -0,0 +1,355 @@
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <daisa/instruction.hpp>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// An in-process, coverage-guided fuzzer for the decoder and the interpreter. Inputs are programs loaded at
+//   00:00, mutated along instruction boundaries, and run in a persistent loop which only resets the pages the
+//   previous run wrote to. Invariant failures and assertion failures leave the input in crash-<pid>.bin.
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+namespace {
+
+  constexpr std::size_t max_input = 512;
+  constexpr u64 step_budget = 256;
+  // past this many inputs, new ones replace the oldest, other than the seeds
+  constexpr std::size_t max_corpus = 8192;
+  // memory outside of the input is filled with hlt, so that stray jumps end the run straight away
+  constexpr u8 background = 0b11001011;
+
+  using Input = std::vector<u8>;
+
+  // the input currently being run, so that it can be saved if we abort
+  u8 crashInput[max_input];
+  std::size_t crashInputSize = 0;
+
+  [[noreturn]] void saveCrash(int) {
+    char name[64];
+    std::snprintf(name, sizeof(name), "crash-%d.bin", static_cast<int>(getpid()));
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      [[maybe_unused]] auto written = write(fd, crashInput, crashInputSize);
+      close(fd);
+    }
+    std::signal(SIGABRT, SIG_DFL);
+    std::abort();
+  }
+
+  [[noreturn]] void fail(char const* what) {
+    std::cerr << "invariant failed: " << what << std::endl;
+    saveCrash(0);
+  }
+
+  // an instruction is either a decoded instruction, or a single byte which failed to decode
+  struct Span {
+    std::size_t offset;
+    std::size_t length;
+  };
+
+  void split(Input const& input, std::vector<Span>& spans) {
+    spans.clear();
+    std::span<u8 const> rest = input;
+    while (!rest.empty()) {
+      auto offset = static_cast<std::size_t>(rest.data() - input.data());
+      auto result = Instruction::disassemble(rest);
+      std::size_t length = result ? result.instruction->length() : 1;
+      spans.push_back({ offset, length });
+      rest = rest.subspan(length);
+    }
+  }
+
+  // the decoder and encoder must agree on every instruction in the input
+  void checkRoundTrip(Input const& input) {
+    static std::vector<Instruction> decoded;
+    static std::vector<u8> expected;
+    decoded.clear();
+    expected.clear();
+    std::span<u8 const> rest = input;
+    while (!rest.empty()) {
+      auto result = Instruction::disassemble(rest);
+      if (!result) {
+        if (result.reason == FailureReason::None)
+          fail("failed decode without a reason");
+        if (result.continueFrom.size() >= rest.size())
+          fail("failed decode consumed nothing");
+        rest = rest.subspan(1);
+        continue;
+      }
+      auto insn = *result.instruction;
+      auto consumed = rest.size() - result.continueFrom.size();
+      if (consumed != insn.length())
+        fail("decoded length differs from consumed bytes");
+      if (insn.encode() != rest[0])
+        fail("encoding differs from decoded byte");
+      if (insn.has_immediate() && insn.immedidate() != rest[1])
+        fail("immediate differs from decoded byte");
+      if (cycle_table[rest[0]] != insn.cycles())
+        fail("cycle table differs from decoded instruction");
+      decoded.push_back(insn);
+      expected.insert(expected.end(), rest.begin(), rest.begin() + consumed);
+      rest = result.continueFrom;
+    }
+
+    // re-assembling the valid instructions must give back exactly their bytes
+    std::span<Instruction const> insns = decoded;
+    auto result = assemble_segment(insns);
+    for (std::size_t i = 0; i < expected.size(); i += 256) {
+      auto count = std::min<std::size_t>(256, expected.size() - i);
+      if (!std::equal(expected.begin() + i, expected.begin() + i + count, result.output.begin()))
+        fail("re-assembled bytes differ");
+      if (result.has_remaining() || result.nextFirstByte)
+        result = assemble_segment(result);
+    }
+  }
+
+  class Mutator {
+    std::mt19937_64 rng;
+    std::vector<Span> spans;
+    std::vector<Span> otherSpans;
+
+    std::size_t below(std::size_t n) { return n ? std::uniform_int_distribution<std::size_t>(0, n - 1)(rng) : 0; }
+    u8 byte() { return static_cast<u8>(rng()); }
+
+    // a random valid instruction, with its immediate if it has one
+    Input instruction() {
+      while (true) {
+        auto first = byte();
+        if (cycle_table[first] == 0)
+          continue;
+        auto data = std::array<u8, 2>{ first, byte() };
+        auto result = Instruction::disassemble(data);
+        return Input(data.begin(), data.begin() + result.instruction->length());
+      }
+    }
+
+  public:
+    explicit Mutator(u64 seed) : rng(seed) {}
+
+    Input mutate(Input input, std::vector<Input> const& corpus) {
+      auto rounds = 1 + below(4);
+      for (auto round = 0u; round < rounds; round++) {
+        split(input, spans);
+        auto pick = spans.empty() ? Span{ 0, 0 } : spans[below(spans.size())];
+        switch (below(spans.empty() ? 1 : 8)) {
+          case 0: { // insert an instruction at a boundary
+            auto insn = instruction();
+            input.insert(input.begin() + pick.offset, insn.begin(), insn.end());
+            break;
+          }
+          case 1: { // replace an instruction
+            auto insn = instruction();
+            input.erase(input.begin() + pick.offset, input.begin() + pick.offset + pick.length);
+            input.insert(input.begin() + pick.offset, insn.begin(), insn.end());
+            break;
+          }
+          case 2: // delete an instruction
+            input.erase(input.begin() + pick.offset, input.begin() + pick.offset + pick.length);
+            break;
+          case 3: // change the immediate, or the argument of one without
+            if (pick.length == 2)
+              input[pick.offset + 1] = below(4) == 0 ? byte() : static_cast<u8>(input[pick.offset + 1] + below(9) - 4);
+            else if ((input[pick.offset] & detail::noarg_check_bits) != detail::noarg_check_bits)
+              input[pick.offset] = static_cast<u8>((input[pick.offset] & 0b11111000) | below(8));
+            break;
+          case 4: { // duplicate a run of instructions
+            auto first = below(spans.size());
+            auto last = std::min(spans.size(), first + 1 + below(8));
+            auto from = spans[first].offset;
+            auto to = spans[last - 1].offset + spans[last - 1].length;
+            Input run(input.begin() + from, input.begin() + to);
+            input.insert(input.begin() + pick.offset, run.begin(), run.end());
+            break;
+          }
+          case 5: { // splice in the tail of another input, at instruction boundaries
+            auto const& other = corpus[below(corpus.size())];
+            split(other, otherSpans);
+            if (otherSpans.empty())
+              break;
+            auto from = otherSpans[below(otherSpans.size())].offset;
+            input.resize(pick.offset);
+            input.insert(input.end(), other.begin() + from, other.end());
+            break;
+          }
+          case 6: // flip a bit anywhere
+            input[below(input.size())] ^= static_cast<u8>(1 << below(8));
+            break;
+          case 7: // swap two instructions
+            {
+              auto other = spans[below(spans.size())];
+              if (other.offset < pick.offset)
+                std::swap(other, pick);
+              if (other.offset >= pick.offset + pick.length) {
+                Input a(input.begin() + pick.offset, input.begin() + pick.offset + pick.length);
+                Input b(input.begin() + other.offset, input.begin() + other.offset + other.length);
+                input.erase(input.begin() + other.offset, input.begin() + other.offset + other.length);
+                input.insert(input.begin() + other.offset, a.begin(), a.end());
+                input.erase(input.begin() + pick.offset, input.begin() + pick.offset + pick.length);
+                input.insert(input.begin() + pick.offset, b.begin(), b.end());
+              }
+            }
+            break;
+        }
+        if (input.size() > max_input)
+          input.resize(max_input);
+      }
+      return input;
+    }
+  };
+
+  // AFL-style hit count buckets, so that loop counts only matter by order of magnitude
+  constexpr std::array<u8, 256> make_buckets() {
+    std::array<u8, 256> buckets{};
+    for (auto i = 0u; i < 256; i++) {
+      buckets[i] = i == 0 ? 0 : i == 1 ? 1 : i == 2 ? 2 : i == 3 ? 4
+        : i < 8 ? 8 : i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+    }
+    return buckets;
+  }
+  constexpr auto buckets = make_buckets();
+
+  struct Fuzzer {
+    std::unique_ptr<Memory> mem;
+    CoverageMap coverage{};
+    CoverageMap seen{};
+    PageMask dirty;
+    std::vector<Input> corpus;
+    std::size_t edges = 0;
+
+    Fuzzer() : mem(std::make_unique<Memory>()) {
+      mem->direct.fill(background);
+    }
+
+    // runs the input, and returns whether it reached anything new
+    bool run(Input const& input) {
+      std::copy(input.begin(), input.end(), crashInput);
+      crashInputSize = input.size();
+
+      checkRoundTrip(input);
+
+      // reset only what the last run touched
+      for (auto page = 0u; page < 256; page++) {
+        if (dirty[page])
+          mem->paged[page].fill(background);
+      }
+      dirty.reset();
+      std::fill(mem->direct.begin(), mem->direct.begin() + max_input, background);
+      std::copy(input.begin(), input.end(), mem->direct.begin());
+      coverage.fill(0);
+
+      // start the stack just below a segment boundary, so that it wraps
+      CpuState state;
+      state.registers.ss = 0x7f;
+      state.registers.named.sp = 0xfc;
+      interpret(*mem, state, Callbacks{
+        .pollInterrupt = [](Memory const&, CpuState const& state) { return state.retired == 48; },
+      }, Options{ .budget = step_budget, .dirtyPages = &dirty, .coverage = &coverage,
+        .extendedArithmetic = true });
+
+      bool interesting = false;
+      for (auto word = 0u; word < coverage.size(); word += sizeof(u64)) {
+        u64 hits;
+        std::memcpy(&hits, &coverage[word], sizeof(hits));
+        if (!hits)
+          continue; // most of the map is empty, so skip it a word at a time
+        for (auto i = word; i < word + sizeof(u64); i++) {
+          auto bucket = buckets[coverage[i]];
+          if ((seen[i] | bucket) != seen[i]) {
+            if (!seen[i])
+              edges++;
+            seen[i] |= bucket;
+            interesting = true;
+          }
+        }
+      }
+      return interesting;
+    }
+  };
+
+}
+
+int main(int argc, char const* const* argv) {
+  u64 runs = 0;
+  u64 seconds = 0;
+  u64 seed = std::random_device{}();
+  for (auto i = 1; i < argc; i += 2) {
+    std::string_view arg = argv[i];
+    std::string_view text = i + 1 < argc ? argv[i + 1] : "";
+    u64 value = 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    bool parsed = !text.empty() && error == std::errc{} && end == text.data() + text.size();
+    if (parsed && arg == "--runs") runs = value;
+    else if (parsed && arg == "--seconds") seconds = value;
+    else if (parsed && arg == "--seed") seed = value;
+    else {
+      std::cerr << "usage: " << argv[0] << " [--runs N] [--seconds N] [--seed N]" << std::endl;
+      return 1;
+    }
+  }
+
+  std::signal(SIGABRT, saveCrash);
+
+  Fuzzer fuzzer;
+  Mutator mutator(seed);
+  fuzzer.corpus = {
+    { 0b11001011 }, // hlt
+    { 0b10010000, 0x7f, 0b00110000, 0xaa, 0b00111001, 0b11001011 }, // ldss 0x7f ; push 0xaa ; pop r1 ; hlt
+    { 0b01000000, 0x04, 0b11000011, 0b00011001, 0x02, 0b11001011 }, // lda 4 ; loop: dec a ; jnz loop ; hlt
+  };
+  for (auto const& input : fuzzer.corpus)
+    fuzzer.run(input);
+  auto const seeds = fuzzer.corpus.size();
+  std::size_t evict = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  auto lastReport = start;
+  u64 execs = 0;
+  while (runs == 0 || execs < runs) {
+    auto const& parent = fuzzer.corpus[execs % fuzzer.corpus.size()];
+    auto input = mutator.mutate(parent, fuzzer.corpus);
+    if (fuzzer.run(input)) {
+      if (fuzzer.corpus.size() < max_corpus) {
+        fuzzer.corpus.push_back(std::move(input));
+      } else {
+        fuzzer.corpus[seeds + evict] = std::move(input);
+        evict = (evict + 1) % (max_corpus - seeds);
+      }
+    }
+    execs++;
+
+    if ((execs & 0xfff) == 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (now - lastReport >= std::chrono::seconds(1)) {
+        auto elapsed = std::chrono::duration<double>(now - start).count();
+        std::cout << "execs: " << execs << " (" << static_cast<u64>(execs / elapsed) << "/s)"
+          << "  corpus: " << fuzzer.corpus.size() << "  edges: " << fuzzer.edges << std::endl;
+        lastReport = now;
+        if (seconds && elapsed >= seconds)
+          break;
+      }
+    }
+  }
+
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "done: " << execs << " execs in " << elapsed << "s, corpus: " << fuzzer.corpus.size()
+    << ", edges: " << fuzzer.edges << std::endl;
+  return 0;
+}
@@ -0,0 +1,513 @@
+#include "gdb.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+namespace {
+
+  constexpr std::string_view target_xml = R"(<?xml version="1.0"?>
+<!DOCTYPE target SYSTEM "gdb-target.dtd">
+<target version="1.0">
+  <feature name="org.daisa.core">
+    <reg name="a" bitsize="8" regnum="0"/>
+    <reg name="cs" bitsize="8"/>
+    <reg name="ds" bitsize="8"/>
+    <reg name="ss" bitsize="8"/>
+    <reg name="ip" bitsize="8"/>
+    <reg name="csr" bitsize="8"/>
+    <reg name="flags" bitsize="8"/>
+    <reg name="r1" bitsize="8"/>
+    <reg name="r2" bitsize="8"/>
+    <reg name="r3" bitsize="8"/>
+    <reg name="r4" bitsize="8"/>
+    <reg name="lr" bitsize="8"/>
+    <reg name="sp" bitsize="8"/>
+    <reg name="bp" bitsize="8"/>
+    <reg name="pc" bitsize="16" type="code_ptr"/>
+  </feature>
+</target>
+)";
+
+  constexpr std::size_t register_count = 15;
+  constexpr std::size_t pc_register = 14;
+  // the PacketSize advertised in qSupported; an M packet's data must fit in one with its address and length
+  constexpr std::size_t packet_size = 0x1000;
+  constexpr u32 max_transfer = packet_size / 2 - 16;
+  // a watchpoint's kind is its length, and one this long already covers all of memory
+  constexpr u32 max_watch_length = 0x10000;
+
+  constexpr char hex_digits[] = "0123456789abcdef";
+
+  void appendHex(std::string& out, u8 value) {
+    out += hex_digits[value >> 4];
+    out += hex_digits[value & 0xf];
+  }
+
+  std::optional<u8> parseHexByte(std::string_view text) {
+    u8 value;
+    if (text.size() < 2)
+      return std::nullopt;
+    auto [end, err] = std::from_chars(text.data(), text.data() + 2, value, 16);
+    if (err != std::errc{} || end != text.data() + 2)
+      return std::nullopt;
+    return value;
+  }
+
+  template<typename T>
+  std::optional<T> parseHex(std::string_view text) {
+    T value;
+    auto [end, err] = std::from_chars(text.data(), text.data() + text.size(), value, 16);
+    if (err != std::errc{} || end != text.data() + text.size())
+      return std::nullopt;
+    return value;
+  }
+
+  // splits "a,b" or "a,b:c" style arguments at the first separator
+  std::pair<std::string_view, std::string_view> split(std::string_view text, char sep) {
+    auto pos = text.find(sep);
+    if (pos == std::string_view::npos)
+      return { text, {} };
+    return { text.substr(0, pos), text.substr(pos + 1) };
+  }
+
+}
+
+GdbStub::GdbStub(Memory& mem, CpuState& state, Callbacks const& callbacks, Options options)
+  : mem(mem), state(state), callbacks(callbacks), options(options)
+{}
+
+bool GdbStub::serveTcp(u16 port) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+    return false;
+  int yes = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(listener);
+    return false;
+  }
+  return acceptOn(listener);
+}
+
+bool GdbStub::serveUnix(std::string const& path) {
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    return false;
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    close(listener);
+    return false;
+  }
+  std::copy(path.begin(), path.end(), addr.sun_path);
+  unlink(path.c_str());
+  if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(listener);
+    return false;
+  }
+  auto result = acceptOn(listener);
+  unlink(path.c_str());
+  return result;
+}
+
+bool GdbStub::acceptOn(int listener) {
+  if (listen(listener, 1) < 0) {
+    close(listener);
+    return false;
+  }
+  int fd = accept(listener, nullptr, nullptr);
+  close(listener);
+  if (fd < 0)
+    return false;
+  int yes = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // fails harmlessly on Unix sockets
+  serveConnection(fd);
+  close(fd);
+  return true;
+}
+
+void GdbStub::serveConnection(int fd) {
+  conn = fd;
+  noAck = startNoAck = false;
+  input.clear();
+  while (auto packet = readPacket()) {
+    bool detach = false;
+    auto reply = packet->empty() ? std::string() : handle(*packet, detach);
+    if (detach && (*packet)[0] == 'k')
+      break; // kill gets no reply
+    sendPacket(reply);
+    if (startNoAck)
+      noAck = true;
+    if (detach)
+      break;
+  }
+  conn = -1;
+}
+
+bool GdbStub::receive(bool block) {
+  char buf[1024];
+  auto count = recv(conn, buf, sizeof(buf), block ? 0 : MSG_DONTWAIT);
+  if (count <= 0)
+    return false;
+  input.append(buf, count);
+  return true;
+}
+
+bool GdbStub::breakRequested() {
+  receive(false);
+  auto pos = input.find('\x03');
+  if (pos == std::string::npos)
+    return false;
+  input.erase(pos, 1);
+  return true;
+}
+
+std::optional<std::string> GdbStub::readPacket() {
+  while (true) {
+    // skip acks, and break requests which arrive while we're already stopped
+    std::size_t start;
+    while ((start = input.find('$')) == std::string::npos) {
+      input.clear();
+      if (!receive(true))
+        return std::nullopt;
+    }
+    std::size_t end;
+    while ((end = input.find('#', start)) == std::string::npos || input.size() < end + 3) {
+      if (!receive(true))
+        return std::nullopt;
+    }
+
+    std::string data;
+    u8 sum = 0;
+    for (auto i = start + 1; i < end; i++) {
+      sum += static_cast<u8>(input[i]);
+      if (input[i] == '}' && i + 1 < end) {
+        i++;
+        sum += static_cast<u8>(input[i]);
+        data += static_cast<char>(input[i] ^ 0x20);
+      } else {
+        data += input[i];
+      }
+    }
+    auto expected = parseHexByte(std::string_view(input).substr(end + 1, 2));
+    input.erase(0, end + 3);
+
+    if (noAck)
+      return data;
+    if (expected && *expected == sum) {
+      send(conn, "+", 1, MSG_NOSIGNAL);
+      return data;
+    }
+    send(conn, "-", 1, MSG_NOSIGNAL);
+  }
+}
+
+void GdbStub::sendPacket(std::string_view data) {
+  std::string packet = "$";
+  u8 sum = 0;
+  for (auto c : data) {
+    if (c == '$' || c == '#' || c == '}' || c == '*') {
+      packet += '}';
+      sum += '}';
+      c ^= 0x20;
+    }
+    packet += c;
+    sum += static_cast<u8>(c);
+  }
+  packet += '#';
+  appendHex(packet, sum);
+
+  while (true) {
+    send(conn, packet.data(), packet.size(), MSG_NOSIGNAL);
+    if (noAck)
+      return;
+    // wait for the ack, resending if the debugger asks for it
+    while (true) {
+      auto pos = input.find_first_of("+-");
+      if (pos != std::string::npos) {
+        auto ack = input[pos];
+        input.erase(0, pos + 1);
+        if (ack == '+')
+          return;
+        break;
+      }
+      if (!receive(true))
+        return;
+    }
+  }
+}
+
+std::string GdbStub::handle(std::string_view packet, bool& detach) {
+  auto args = packet.substr(1);
+  switch (packet[0]) {
+    case '?':
+      return stopReply();
+    case 'g':
+      return readRegisters();
+    case 'G':
+      for (auto i = 0u; i < register_count - 1; i++) {
+        auto value = parseHexByte(args.substr(std::min<std::size_t>(i * 2, args.size())));
+        if (!value)
+          return "E01";
+        writeRegister(i, *value);
+      }
+      return "OK";
+    case 'p':
+      {
+        auto index = parseHex<std::size_t>(args);
+        auto value = index ? readRegister(*index) : std::nullopt;
+        if (!value)
+          return "E01";
+        std::string out;
+        appendHex(out, static_cast<u8>(*value & 0xff));
+        if (*index == pc_register)
+          appendHex(out, static_cast<u8>(*value >> 8));
+        return out;
+      }
+    case 'P':
+      {
+        auto [indexText, valueText] = split(args, '=');
+        auto index = parseHex<std::size_t>(indexText);
+        auto low = parseHexByte(valueText);
+        if (!index || !low)
+          return "E01";
+        u16 value = *low;
+        if (auto high = parseHexByte(valueText.substr(std::min<std::size_t>(2, valueText.size()))))
+          value |= *high << 8;
+        return writeRegister(*index, value) ? "OK" : "E01";
+      }
+    case 'm':
+      {
+        auto [addrText, lenText] = split(args, ',');
+        auto addr = parseHex<u32>(addrText);
+        auto len = parseHex<u32>(lenText);
+        if (!addr || !len || *len > max_transfer)
+          return "E01";
+        std::string out;
+        for (u32 i = 0; i < *len; i++)
+          appendHex(out, mem.direct[(*addr + i) & 0xffff]);
+        return out;
+      }
+    case 'M':
+      {
+        auto [range, data] = split(args, ':');
+        auto [addrText, lenText] = split(range, ',');
+        auto addr = parseHex<u32>(addrText);
+        auto len = parseHex<u32>(lenText);
+        if (!addr || !len || *len > max_transfer || data.size() / 2 < *len)
+          return "E01";
+        for (u32 i = 0; i < *len; i++) {
+          auto value = parseHexByte(data.substr(i * 2));
+          if (!value)
+            return "E01";
+          auto at = (*addr + i) & 0xffff;
+          mem.direct[at] = *value;
+          // the same as a store from the guest
+          if (options.dirtyPages)
+            (*options.dirtyPages)[at >> 8] = true;
+          if (options.traces)
+            options.traces->invalidate(static_cast<u8>(at >> 8));
+        }
+        return "OK";
+      }
+    case 'c':
+    case 's':
+      if (!args.empty()) {
+        auto addr = parseHex<u16>(args);
+        if (!addr)
+          return "E01";
+        writeRegister(pc_register, *addr);
+      }
+      return resume(packet[0] == 's');
+    case 'Z':
+    case 'z':
+      return setBreakpoint(args, packet[0] == 'Z');
+    case 'H':
+    case 'T':
+      return "OK";
+    case 'D':
+      detach = true;
+      return "OK";
+    case 'k':
+      detach = true;
+      return "";
+    case 'Q':
+      if (packet == "QStartNoAckMode") {
+        startNoAck = true; // the reply to this is still acknowledged
+        return "OK";
+      }
+      return "";
+    case 'q':
+      if (packet.starts_with("qSupported"))
+        return "PacketSize=1000;qXfer:features:read+;QStartNoAckMode+";
+      if (packet == "qAttached")
+        return "1";
+      if (packet == "qC")
+        return "QC1";
+      if (packet == "qfThreadInfo")
+        return "m1";
+      if (packet == "qsThreadInfo")
+        return "l";
+      if (packet.starts_with("qXfer:features:read:target.xml:")) {
+        auto [offText, lenText] = split(packet.substr(31), ',');
+        auto off = parseHex<std::size_t>(offText);
+        auto len = parseHex<std::size_t>(lenText);
+        if (!off || !len)
+          return "E01";
+        if (*off >= target_xml.size())
+          return "l";
+        auto chunk = target_xml.substr(*off, *len);
+        return (*off + chunk.size() < target_xml.size() ? "m" : "l") + std::string(chunk);
+      }
+      return "";
+    default:
+      return "";
+  }
+}
+
+std::string GdbStub::stopReply() const {
+  char buf[32];
+  switch (lastStop.reason) {
+    case StopReason::Halted:
+      return "W00";
+    case StopReason::InvalidInstruction:
+      return "S04"; // SIGILL
+    case StopReason::ReadWatchpoint:
+      std::snprintf(buf, sizeof(buf), "T05rwatch:%04x;", lastStop.address);
+      return buf;
+    case StopReason::WriteWatchpoint:
+      std::snprintf(buf, sizeof(buf), "T05watch:%04x;", lastStop.address);
+      return buf;
+    case StopReason::Breakpoint:
+    case StopReason::BudgetExhausted:
+    case StopReason::HostCall:
+      return interrupted ? "S02" : "S05";
+  }
+  return "S05";
+}
+
+std::string GdbStub::resume(bool step) {
+  auto runOptions = options;
+  runOptions.breakpoints = &breakpoints;
+  runOptions.budget = step ? 1 : resume_slice;
+  runOptions.stepOverBreakpoint = lastStop.reason == StopReason::Breakpoint;
+  interrupted = false;
+
+  while (true) {
+    lastStop = interpret(mem, state, callbacks, runOptions);
+    if (step || lastStop.reason != StopReason::BudgetExhausted)
+      break;
+    runOptions.stepOverBreakpoint = false;
+    if (breakRequested()) {
+      interrupted = true;
+      break;
+    }
+  }
+
+  return stopReply();
+}
+
+std::string GdbStub::readRegisters() const {
+  std::string out;
+  for (auto i = 0u; i < register_count - 1; i++)
+    appendHex(out, static_cast<u8>(*readRegister(i)));
+  auto pc = *readRegister(pc_register);
+  appendHex(out, static_cast<u8>(pc & 0xff));
+  appendHex(out, static_cast<u8>(pc >> 8));
+  return out;
+}
+
+std::optional<u16> GdbStub::readRegister(std::size_t index) const {
+  auto const& regs = state.registers;
+  switch (index) {
+    case 0: return regs.a;
+    case 1: return regs.cs;
+    case 2: return regs.ds;
+    case 3: return regs.ss;
+    case 4: return regs.ip;
+    case 5: return regs.csr;
+    case 6: case 7: case 8: case 9: case 10: case 11: case 12: case 13:
+      return regs.addressable[index - 6];
+    case pc_register: return static_cast<u16>((regs.cs << 8) | regs.ip);
+    default: return std::nullopt;
+  }
+}
+
+bool GdbStub::writeRegister(std::size_t index, u16 value) {
+  auto& regs = state.registers;
+  auto byte = static_cast<u8>(value & 0xff);
+  switch (index) {
+    case 0: regs.a = byte; return true;
+    case 1: regs.cs = byte; return true;
+    case 2: regs.ds = byte; return true;
+    case 3: regs.ss = byte; return true;
+    case 4: regs.ip = byte; return true;
+    case 5: regs.csr = byte; return true;
+    case 6: case 7: case 8: case 9: case 10: case 11: case 12: case 13:
+      regs.addressable[index - 6] = byte;
+      return true;
+    case pc_register:
+      regs.cs = static_cast<u8>(value >> 8);
+      regs.ip = byte;
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::string GdbStub::setBreakpoint(std::string_view args, bool set) {
+  auto [typeText, rest] = split(args, ',');
+  auto [addrText, kindText] = split(rest, ',');
+  auto type = parseHex<u32>(typeText);
+  auto addr = parseHex<u32>(addrText);
+  auto kind = parseHex<u32>(kindText);
+  if (!type || !addr || !kind)
+    return "E01";
+  if (*type >= 2 && *type <= 4 && (*kind == 0 || *kind > max_watch_length))
+    return "E01";
+
+  auto apply = [&](Breakpoints::PageSet& pages, u32 length) {
+    for (u32 i = 0; i < length; i++) {
+      auto at = static_cast<u16>((*addr + i) & 0xffff);
+      if (set)
+        pages.set(at);
+      else
+        pages.reset(at);
+    }
+  };
+  switch (*type) {
+    case 0: // software breakpoint
+    case 1: // hardware breakpoint
+      apply(breakpoints.execute, 1);
+      return "OK";
+    case 2: // write watchpoint
+      apply(breakpoints.write, *kind);
+      return "OK";
+    case 3: // read watchpoint
+      apply(breakpoints.read, *kind);
+      return "OK";
+    case 4: // access watchpoint
+      apply(breakpoints.read, *kind);
+      apply(breakpoints.write, *kind);
+      return "OK";
+    default:
+      return "";
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace daisa::interpreter {
+
+  /// @brief A GDB remote serial protocol stub, serving a single debugger connection over a local socket.
+  /// @note Memory is addressed with flat 16-bit addresses. Registers are described to the debugger as
+  ///   a, cs, ds, ss, ip, csr, flags, r1, r2, r3, r4, lr, sp, bp (8 bits each), then pc (cs:ip, 16 bits).
+  class GdbStub {
+  public:
+    GdbStub(Memory& mem, CpuState& state, Callbacks const& callbacks, Options options = {});
+
+    /// @brief Listens on a TCP port on the loopback interface, and serves the first connection until it detaches.
+    /// @return Whether the socket could be set up.
+    bool serveTcp(u16 port);
+    /// @brief Listens on a Unix domain socket, and serves the first connection until it detaches.
+    /// @return Whether the socket could be set up.
+    bool serveUnix(std::string const& path);
+    /// @brief Serves an already connected socket until the debugger detaches. Does not close it.
+    void serveConnection(int fd);
+
+  private:
+    /// instructions to run between checks for a break request from the debugger
+    static constexpr u64 resume_slice = 1 << 16;
+
+    Memory& mem;
+    CpuState& state;
+    Callbacks const& callbacks;
+    Options options;
+    Breakpoints breakpoints;
+
+    int conn = -1;
+    bool noAck = false;
+    bool startNoAck = false;
+    std::string input;
+    Stop lastStop{ StopReason::BudgetExhausted };
+    bool interrupted = false;
+
+    bool acceptOn(int listener);
+    bool receive(bool block);
+    bool breakRequested();
+    std::optional<std::string> readPacket();
+    void sendPacket(std::string_view data);
+
+    std::string handle(std::string_view packet, bool& detach);
+    std::string stopReply() const;
+    std::string resume(bool step);
+
+    std::string readRegisters() const;
+    std::optional<u16> readRegister(std::size_t index) const;
+    bool writeRegister(std::size_t index, u16 value);
+    std::string setBreakpoint(std::string_view args, bool set);
+  };
+
+}
@@ -0,0 +1,195 @@
+#include "history.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+History::History(Memory& mem, CpuState& state, Callbacks const& callbacks, Options options, u64 interval)
+  : mem(mem), state(state), callbacks(callbacks), options(options), snapshotInterval(interval),
+    callerDirty(options.dirtyPages), shadow(std::make_unique<Memory>(mem)) {
+  if (options.mmioPages || options.pmu)
+    throw std::invalid_argument("History can't snapshot device or performance counter state");
+  this->options.dirtyPages = &dirty;
+  snapshots.push_back(Snapshot{ state, {}, 0, 0, 0 });
+
+  // the hooks replay what was logged until re-execution passes the furthest point reached, then record again;
+  //   they are only set where the host's are, since interpret behaves differently without them
+  if (callbacks.pollInterrupt) {
+    hooks.pollInterrupt = [this](Memory const& mem, CpuState const& state) {
+      auto point = std::pair{ state.retired, state.cycles };
+      if (lastPoll && point <= *lastPoll) {
+        if (interruptCursor < interrupts.size() && interrupts[interruptCursor] == point) {
+          interruptCursor++;
+          return true;
+        }
+        return false;
+      }
+      lastPoll = point;
+      if (!this->callbacks.pollInterrupt(mem, state))
+        return false;
+      interrupts.push_back(point);
+      interruptCursor = interrupts.size();
+      return true;
+    };
+  }
+  if (callbacks.nextInterrupt) {
+    hooks.nextInterrupt = [this](CpuState const& state) {
+      if (nextInterruptCursor < nextInterrupts.size())
+        return nextInterrupts[nextInterruptCursor++];
+      nextInterrupts.push_back(this->callbacks.nextInterrupt(state));
+      nextInterruptCursor = nextInterrupts.size();
+      return nextInterrupts.back();
+    };
+  }
+  if (callbacks.hostCall) {
+    hooks.hostCall = [this](HostCall const& call, std::span<u8> buffer) {
+      if (hostCallCursor < hostCalls.size()) {
+        auto const& result = hostCalls[hostCallCursor++];
+        std::copy(result.data.begin(), result.data.end(), buffer.begin());
+        return result.transferred;
+      }
+      auto transferred = this->callbacks.hostCall(call, buffer);
+      auto& result = hostCalls.emplace_back(HostCallResult{ transferred, {} });
+      if (transferred && call.service != HostService::Write)
+        result.data.assign(buffer.begin(), buffer.begin() + *transferred);
+      hostCallCursor = hostCalls.size();
+      return transferred;
+    };
+  }
+}
+
+void History::takeSnapshot() {
+  auto& last = snapshots.back();
+  for (auto page = 0u; page < mem.paged.size(); page++) {
+    if (!dirty[page])
+      continue;
+    last.undo.emplace_back(static_cast<u8>(page), shadow->paged[page]);
+    shadow->paged[page] = mem.paged[page];
+  }
+  dirty.reset();
+  snapshots.push_back(Snapshot{ state, {}, interruptCursor, nextInterruptCursor, hostCallCursor });
+}
+
+void History::restore(std::size_t snapshot) {
+  // first back to the latest snapshot, then undo each interval before it in turn
+  PageMask changed = dirty;
+  for (auto page = 0u; page < mem.paged.size(); page++) {
+    if (dirty[page])
+      mem.paged[page] = shadow->paged[page];
+  }
+  for (auto i = snapshots.size() - 1; i-- > snapshot;) {
+    for (auto const& [page, contents] : snapshots[i].undo) {
+      mem.paged[page] = contents;
+      changed[page] = true;
+    }
+  }
+  if (callerDirty)
+    *callerDirty |= changed;
+  snapshots.resize(snapshot + 1);
+
+  auto& target = snapshots.back();
+  target.undo.clear();
+  *shadow = mem;
+  dirty.reset();
+  if (options.traces)
+    options.traces->clear();
+  state = target.state;
+  interruptCursor = target.interruptCursor;
+  nextInterruptCursor = target.nextInterruptCursor;
+  hostCallCursor = target.hostCallCursor;
+}
+
+Stop History::advance(u64 target, Breakpoints const* breakpoints, bool stepOverFirst) {
+  auto runOptions = options;
+  runOptions.breakpoints = breakpoints;
+  runOptions.stepOverBreakpoint = stepOverFirst;
+  while (state.retired < target) {
+    // stop at each snapshot boundary, so that snapshots are always taken at the same points
+    auto boundary = snapshots.back().state.retired + snapshotInterval;
+    runOptions.budget = std::min(boundary, target) - state.retired;
+    auto stop = interpret(mem, state, hooks, runOptions);
+    runOptions.stepOverBreakpoint = false;
+    if (callerDirty)
+      *callerDirty |= dirty;
+    if (state.retired == boundary)
+      takeSnapshot();
+    if (stop.reason != StopReason::BudgetExhausted)
+      return stop;
+  }
+  return Stop{ StopReason::BudgetExhausted };
+}
+
+Stop History::run(u64 count) {
+  auto target = count ? state.retired + count : std::numeric_limits<u64>::max();
+  auto stop = advance(target, options.breakpoints, stepOver);
+  stepOver = stop.reason == StopReason::Breakpoint;
+  return stop;
+}
+
+bool History::seek(u64 retired) {
+  if (retired < start())
+    return false;
+  if (retired < state.retired) {
+    auto after = std::upper_bound(snapshots.begin(), snapshots.end(), retired,
+      [](u64 retired, Snapshot const& snapshot) { return retired < snapshot.state.retired; });
+    restore(static_cast<std::size_t>(after - snapshots.begin()) - 1);
+  }
+  advance(retired, nullptr, false);
+  stepOver = true;
+  return state.retired == retired;
+}
+
+bool History::reverseStep() {
+  if (state.retired == start())
+    return false;
+  return seek(state.retired - 1);
+}
+
+std::optional<Stop> History::reverseSearch(Breakpoints const* breakpoints) {
+  auto now = state.retired;
+  // search each interval between snapshots from the latest back, re-executing it with the breakpoints set
+  for (auto snapshot = snapshots.size() - 1;; snapshot--) {
+    auto end = snapshot + 1 < snapshots.size() ? snapshots[snapshot + 1].state.retired : now;
+    restore(snapshot);
+
+    std::optional<std::pair<u64, Stop>> last;
+    bool resuming = false;
+    while (breakpoints && state.retired < end) {
+      auto stop = advance(end, breakpoints, resuming);
+      resuming = false;
+      if (stop.reason == StopReason::Breakpoint) {
+        last = { state.retired, stop };
+        resuming = true;
+      } else if (stop.reason == StopReason::ReadWatchpoint || stop.reason == StopReason::WriteWatchpoint) {
+        last = { state.retired - 1, stop };
+      } else if (stop.reason != StopReason::BudgetExhausted) {
+        break;
+      }
+    }
+
+    if (last) {
+      seek(last->first);
+      return last->second;
+    }
+    if (snapshot == 0) {
+      seek(start());
+      return std::nullopt;
+    }
+  }
+}
+
+std::optional<Stop> History::reverseContinue() {
+  return reverseSearch(options.breakpoints);
+}
+
+std::optional<u64> History::reverseToLastWrite(u16 address) {
+  auto watch = std::make_unique<Breakpoints>();
+  watch->write.set(address);
+  if (!reverseSearch(watch.get()))
+    return std::nullopt;
+  return state.retired;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Records a machine's execution so that it can be run backwards, by restoring a periodic snapshot
+  ///   and deterministically re-executing from it to any earlier retired instruction.
+  /// @note Everything the callbacks return is logged and replayed when re-executing, so the host only sees
+  ///   each interrupt poll and host call once. Memory must not be written by anything else while recording,
+  ///   and Options::sharedMemory is not supported. Snapshots only hold memory and the CPU, so state kept by
+  ///   devices (such as Banks' backing store and Dma's pending transfer) or a Pmu would not go back with them;
+  ///   Options::mmioPages and Options::pmu are rejected for that reason. Options::dirtyPages is still marked,
+  ///   including for the pages a restore changes.
+  class History {
+  public:
+    /// @param[in]  interval  The number of instructions retired between snapshots. Going back costs up to this many
+    ///   instructions of re-execution (around 16 ns each), so the default keeps a reverse step around 20 ms.
+    /// @throws std::invalid_argument if Options::mmioPages or Options::pmu is set.
+    History(Memory& mem, CpuState& state, Callbacks const& callbacks, Options options = {}, u64 interval = 1 << 20);
+
+    History(History const&) = delete;
+    History& operator=(History const&) = delete;
+
+    /// @brief Runs forwards, stopping at breakpoints and watchpoints in Options::breakpoints.
+    /// @param[in]  count  The number of instructions to retire before stopping; 0 for no limit.
+    Stop run(u64 count = 0);
+
+    /// @brief Goes back one instruction.
+    /// @return Whether there was an instruction to go back over.
+    bool reverseStep();
+    /// @brief Goes back to the last point before now at which a breakpoint or watchpoint would have stopped
+    ///   execution; for a watchpoint, that is just before the instruction that hit it. If there was none, goes
+    ///   back to the start of the recording.
+    /// @return The stop, or nothing if there was none.
+    std::optional<Stop> reverseContinue();
+    /// @brief Goes back to just before the last instruction that wrote to an address, which is then at cs:ip.
+    /// @return The number of instructions retired before it, or nothing if it was not written since recording began.
+    std::optional<u64> reverseToLastWrite(u16 address);
+
+    /// @brief Goes to the point at which the given number of instructions had been retired, backwards or forwards.
+    /// @return Whether that point was reached; going forwards may stop early if the machine stops.
+    bool seek(u64 retired);
+
+    [[nodiscard]] u64 interval() const noexcept { return snapshotInterval; }
+    [[nodiscard]] std::size_t snapshotCount() const noexcept { return snapshots.size(); }
+    /// the number of instructions retired when recording began, which is as far back as it can go
+    [[nodiscard]] u64 start() const noexcept { return snapshots.front().state.retired; }
+
+  private:
+    using Page = std::array<u8, 256>;
+
+    struct Snapshot {
+      CpuState state;
+      /// the pages written between this snapshot and the next, as they were at this one
+      std::vector<std::pair<u8, Page>> undo;
+      std::size_t interruptCursor;
+      std::size_t nextInterruptCursor;
+      std::size_t hostCallCursor;
+    };
+
+    struct HostCallResult {
+      std::optional<u16> transferred;
+      std::vector<u8> data;
+    };
+
+    Memory& mem;
+    CpuState& state;
+    Callbacks const& callbacks;
+    Options options;
+    u64 snapshotInterval;
+
+    Callbacks hooks;
+    PageMask dirty;
+    /// the caller's Options::dirtyPages, which our own replaces while interpreting
+    PageMask* callerDirty;
+    std::unique_ptr<Memory> shadow;
+    std::vector<Snapshot> snapshots;
+    /// set after stopping at a breakpoint or travelling, so that running again doesn't stop where it already is
+    bool stepOver = false;
+
+    /// (retired, cycles) of each poll that raised an interrupt; polls are only ever made once at each point
+    std::vector<std::pair<u64, u64>> interrupts;
+    std::optional<std::pair<u64, u64>> lastPoll;
+    std::vector<std::optional<u64>> nextInterrupts;
+    std::vector<HostCallResult> hostCalls;
+    std::size_t interruptCursor = 0;
+    std::size_t nextInterruptCursor = 0;
+    std::size_t hostCallCursor = 0;
+
+    void takeSnapshot();
+    void restore(std::size_t snapshot);
+    Stop advance(u64 target, Breakpoints const* breakpoints, bool stepOverFirst);
+    std::optional<Stop> reverseSearch(Breakpoints const* breakpoints);
+  };
+
+}
@@ -0,0 +1,49 @@
+#include "hostio.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+HostIO::HostIO() noexcept {
+  channels[0] = stdin;
+  channels[1] = stdout;
+  channels[2] = stderr;
+}
+
+std::optional<u16> HostIO::operator()(HostCall const& call, std::span<u8> buffer) {
+  auto* file = channels[call.channel];
+  switch (call.service) {
+    case HostService::Write:
+      {
+        if (!file)
+          return std::nullopt;
+        auto written = std::fwrite(buffer.data(), 1, buffer.size(), file);
+        if (written != buffer.size())
+          return std::nullopt;
+        return static_cast<u16>(written);
+      }
+    case HostService::Read:
+      {
+        if (!file)
+          return std::nullopt;
+        auto read = std::fread(buffer.data(), 1, buffer.size(), file);
+        if (read != buffer.size() && std::ferror(file))
+          return std::nullopt;
+        return static_cast<u16>(read); // a short read is end of input
+      }
+    case HostService::Time:
+      {
+        using namespace std::chrono;
+        auto now = static_cast<u64>(duration_cast<microseconds>(system_clock::now().time_since_epoch()).count());
+        auto count = std::min<std::size_t>(buffer.size(), sizeof(now));
+        for (auto i = 0u; i < count; i++)
+          buffer[i] = static_cast<u8>(now >> (8 * i));
+        return static_cast<u16>(count);
+      }
+    case HostService::End:
+      break;
+  }
+  return std::nullopt;
+}
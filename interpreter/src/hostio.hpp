@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <array>
+#include <cstdio>
+#include <optional>
+#include <span>
+
+namespace daisa::interpreter {
+
+  /// @brief Services hcall requests using host streams, with one stdio call per buffer.
+  /// @note Channel 0 reads from stdin, 1 writes to stdout, and 2 writes to stderr. Pass it to
+  ///   Callbacks::hostCall through std::ref, so that channels attached later are seen.
+  class HostIO {
+    std::array<std::FILE*, 256> channels = {};
+
+  public:
+    HostIO() noexcept;
+
+    /// @brief Attaches a stream to a channel, replacing whatever was there. Null detaches it.
+    /// @note The stream is not closed when it is replaced.
+    void attach(u8 channel, std::FILE* file) noexcept { channels[channel] = file; }
+
+    /// @brief Services one request.
+    /// @return The number of bytes transferred, or nothing if the channel or service is unknown, or the transfer failed.
+    std::optional<u16> operator()(HostCall const& call, std::span<u8> buffer);
+  };
+
+}
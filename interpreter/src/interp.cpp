@@ -1,7 +1,12 @@
 #include "interp.hpp"
+#include "pmu.hpp"
+#include "trace.hpp"
 #include "types.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <daisa/instruction.hpp>
 
 using namespace daisa;
@@ -12,9 +17,151 @@ void daisa::interpreter::interpret(
   u16 startAddr,
   std::function<bool(Memory const&, RegisterPage const&)> pollInterrupt
 ) {
-  bool halt = false;
-  bool intEnabled = true;
-  RegisterPage registers;
+  CpuState state;
+  state.registers.cs = static_cast<u8>((0xff00 & startAddr) >> 8);
+  state.registers.ip = static_cast<u8>(0xff & startAddr);
+  interpret(mem, state, Callbacks{
+    .pollInterrupt = [&](Memory const& m, CpuState const& s) {
+      return pollInterrupt(m, s.registers);
+    },
+  });
+}
+
+u8 daisa::interpreter::serviceHostCalls(
+  Memory& mem,
+  u8 seg,
+  u8 off,
+  Callbacks const& callbacks,
+  Options const& options
+) {
+  auto load = [&](u8& cell) -> u8 {
+    if (options.sharedMemory)
+      return std::atomic_ref(cell).load();
+    return cell;
+  };
+  auto store = [&](u8& cell, u8 val) {
+    if (options.sharedMemory)
+      std::atomic_ref(cell).store(val);
+    else
+      cell = val;
+  };
+  auto markDirty = [&](std::size_t first, std::size_t count) {
+    if (count == 0)
+      return;
+    for (auto page = first >> 8; page <= (first + count - 1) >> 8; page++) {
+      if (options.dirtyPages)
+        (*options.dirtyPages)[page] = true;
+      if (options.traces)
+        options.traces->invalidate(static_cast<u8>(page));
+    }
+  };
+
+  // the list is a run of descriptors in one segment, ended by HostService::End or the end of the segment;
+  //   buffers are handed to the host directly, so they are neither atomic nor watched
+  u8 failed = 0;
+  for (auto at = static_cast<unsigned>(off); at + host_call_size <= 256; at += host_call_size) {
+    auto* desc = &mem.paged[seg][at];
+    auto service = static_cast<HostService>(load(desc[0]));
+    if (service == HostService::End)
+      break;
+    auto bufAddr = static_cast<std::size_t>((load(desc[2]) << 8) | load(desc[3]));
+    auto length = static_cast<u16>(load(desc[4]) | (load(desc[5]) << 8));
+    // a buffer may cross segments, but not wrap around the end of memory
+    std::span buffer{&mem.direct[bufAddr], std::min<std::size_t>(length, (256*256) - bufAddr)};
+
+    std::optional<u16> done;
+    if (callbacks.hostCall)
+      done = callbacks.hostCall(HostCall{ service, load(desc[1]) }, buffer);
+    if (done) {
+      assert(*done <= buffer.size());
+      if (service != HostService::Write)
+        markDirty(bufAddr, *done);
+    } else {
+      failed++;
+    }
+    store(desc[4], static_cast<u8>(done.value_or(0) & 0xff));
+    store(desc[5], static_cast<u8>(done.value_or(0) >> 8));
+    store(desc[6], done ? 0 : 1);
+    markDirty(static_cast<std::size_t>((seg << 8) | at), host_call_size);
+  }
+  return failed;
+}
+
+void daisa::interpreter::mmioWrite(
+  Memory& mem,
+  u16 addr,
+  u8 val,
+  Callbacks const& callbacks,
+  Options const& options
+) {
+  PageMask changed;
+  callbacks.mmioWrite(mem, addr, val, changed);
+  if (changed.none())
+    return;
+  for (auto page = 0u; page < changed.size(); page++) {
+    if (!changed[page])
+      continue;
+    if (options.dirtyPages)
+      (*options.dirtyPages)[page] = true;
+    if (options.traces)
+      options.traces->invalidate(static_cast<u8>(page));
+  }
+}
+
+InterpreterFn daisa::interpreter::selectInterpreter(Options const& options, Callbacks const& callbacks) noexcept {
+  if (BareConfig::supports(options, callbacks))
+    return &Interpreter<BareConfig>::run;
+  if (InterruptConfig::supports(options, callbacks))
+    return &Interpreter<InterruptConfig>::run;
+  if (HostedConfig::supports(options, callbacks))
+    return &Interpreter<HostedConfig>::run;
+  return &Interpreter<FullConfig>::run;
+}
+
+Stop daisa::interpreter::interpret(
+  Memory& mem,
+  CpuState& state,
+  Callbacks const& callbacks,
+  Options options
+) {
+  return selectInterpreter(options, callbacks)(mem, state, callbacks, options);
+}
+
+// every check for an optional feature is behind `if constexpr` on Config, so that a config without it runs a loop
+//   which doesn't look at its options at all
+template <typename Config>
+Stop Interpreter<Config>::run(
+  Memory& mem,
+  CpuState& state,
+  Callbacks const& callbacks,
+  Options const& options
+) {
+  assert(Config::supports(options, callbacks));
+  auto& registers = state.registers;
+  auto& intEnabled = state.intEnabled;
+
+  // traces run without checking for any of these
+  TraceCache* traces = nullptr;
+  if constexpr (Config::hooks) {
+    if (!options.breakpoints && !options.coverage && !options.sharedMemory && !options.skipIdleLoops)
+      traces = options.traces;
+  }
+  Pmu* pmu = nullptr;
+  if constexpr (Config::hooks)
+    pmu = options.pmu;
+  // instructions and cycles reach the pmu at the end of each block, and whenever we stop
+  auto syncPmu = [&] {
+    if (pmu)
+      pmu->sync(state);
+  };
+  struct SyncOnStop {
+    Pmu* pmu;
+    CpuState const& state;
+    ~SyncOnStop() {
+      if (pmu)
+        pmu->sync(state);
+    }
+  } syncOnStop{ pmu, state };
 
   auto toSegmented = [](u16 addr) {
     struct ret {
@@ -34,10 +181,179 @@ void daisa::interpreter::interpret(
     registers.cs = cs;
     registers.ip = ip;
   };
-  setIP(startAddr);
 
-  while (!halt) {
+  // when memory is shared with other cores, every data access is a single-copy atomic byte access;
+  //   ldm, stm and the interrupt vector are sequentially consistent, while the stack is core-private
+  auto load = [&](u8& cell, [[maybe_unused]] std::memory_order order = std::memory_order_seq_cst) -> u8 {
+    if constexpr (Config::sharedMemory) {
+      if (options.sharedMemory)
+        return std::atomic_ref(cell).load(order);
+    }
+    return cell;
+  };
+  bool wroteMemory = false;
+  auto store = [&](u8& cell, u8 val, [[maybe_unused]] std::memory_order order = std::memory_order_seq_cst) {
+    if constexpr (Config::sharedMemory) {
+      if (options.sharedMemory)
+        std::atomic_ref(cell).store(val, order);
+      else
+        cell = val;
+    } else {
+      cell = val;
+    }
+    if constexpr (Config::hooks) {
+      auto addr = &cell - mem.direct.data();
+      if (options.dirtyPages)
+        (*options.dirtyPages)[addr >> 8] = true;
+      if (traces)
+        traces->written(static_cast<u8>(addr >> 8), static_cast<u8>(addr & 0xff));
+      wroteMemory = true;
+      if (options.mmioPages && (*options.mmioPages)[addr >> 8] && callbacks.mmioWrite) {
+        syncPmu();
+        mmioWrite(mem, static_cast<u16>(addr), val, callbacks, options);
+      }
+    }
+  };
+
+  // a watchpoint hit stops execution once the instruction that hit it has finished and any interrupt due after it has been taken
+  auto const* breakpoints = Config::debug ? options.breakpoints : nullptr;
+  std::optional<Stop> watchHit;
+  auto watch = [&](StopReason reason, u8 seg, u8 off) {
+    if constexpr (Config::debug) {
+      if (!breakpoints)
+        return;
+      auto const& set = reason == StopReason::ReadWatchpoint ? breakpoints->read : breakpoints->write;
+      if (set.test(seg, off))
+        watchHit = Stop{ reason, static_cast<u16>(realAddr(seg, off)) };
+    }
+  };
+
+  // ss:sp behaves as one 16-bit pointer, wrapping around the whole address space
+  auto stackAddr = [&] { return realAddr(registers.ss, registers.named.sp); };
+  auto pushStack = [&](u8 val) {
+    [[maybe_unused]] auto before = stackAddr();
+    watch(StopReason::WriteWatchpoint, registers.ss, registers.named.sp);
+    store(mem.paged[registers.ss][registers.named.sp], val, std::memory_order_relaxed);
+    if (registers.named.sp++ == 0xff)
+      registers.ss++;
+    assert(stackAddr() == ((before + 1) & 0xffff));
+    if (pmu)
+      pmu->pushed(static_cast<u16>(stackAddr()));
+  };
+  auto popStack = [&]() {
+    [[maybe_unused]] auto before = stackAddr();
+    if (registers.named.sp-- == 0x00)
+      registers.ss--;
+    assert(stackAddr() == ((before - 1) & 0xffff));
+    watch(StopReason::ReadWatchpoint, registers.ss, registers.named.sp);
+    return load(mem.paged[registers.ss][registers.named.sp], std::memory_order_relaxed);
+  };
+
+  auto takeInterrupt = [&]() {
+    auto seg = load(mem.paged[0xff][0xfe]);
+    auto off = load(mem.paged[0xff][0xff]);
+    intEnabled = false;
+    state.halted = false;
+    pushStack(registers.cs);
+    pushStack(registers.ip);
+    registers.cs = seg;
+    registers.ip = off;
+    if (pmu) {
+      pmu->interruptTaken();
+      pmu->masked(state.cycles);
+    }
+    state.cycles += interrupt_entry_cycles;
+    syncPmu();
+  };
+
+  // fast-forwards the cycle counter to the next scheduled interrupt, in whole multiples of period;
+  // returns false if it is known that no interrupt is scheduled
+  auto skipToInterrupt = [&](u64 period) {
+    if (!callbacks.nextInterrupt)
+      return true;
+    auto next = callbacks.nextInterrupt(state);
+    if (!next)
+      return false;
+    if (*next > state.cycles)
+      state.cycles += (*next - state.cycles + period - 1) / period * period;
+    return true;
+  };
+
+  // the state at the target of the last backwards near jump; if we get back there with nothing changed,
+  //   every further iteration will do exactly the same thing until an interrupt arrives
+  struct {
+    u16 head;
+    u64 cycles;
+    RegisterPage registers;
+    bool intEnabled;
+    bool valid = false;
+  } idleLoop;
+  auto checkIdleLoop = [&](u8 fromIp) {
+    if (registers.ip > fromIp)
+      return;
+    auto head = realAddr(registers.cs, registers.ip);
+    if (idleLoop.valid && idleLoop.head == head && !wroteMemory && idleLoop.intEnabled == intEnabled
+      && std::memcmp(&idleLoop.registers, &registers, sizeof(RegisterPage)) == 0) {
+      if (intEnabled)
+        skipToInterrupt(state.cycles - idleLoop.cycles);
+    }
+    idleLoop.head = head;
+    idleLoop.cycles = state.cycles;
+    idleLoop.registers = registers;
+    idleLoop.intEnabled = intEnabled;
+    idleLoop.valid = true;
+    wroteMemory = false;
+  };
+
+  [[maybe_unused]] bool resuming = options.stepOverBreakpoint;
+  [[maybe_unused]] u64 steps = 0;
+  [[maybe_unused]] u16 prevAddr = 0;
+
+  while (true) {
+    if constexpr (Config::hooks) {
+      if (options.budget && steps++ == options.budget)
+        return Stop{ StopReason::BudgetExhausted };
+    }
+
+    if (state.halted) {
+      // only pollInterrupt can deliver an interrupt, so without it waiting would never end
+      if (options.haltMode == HaltMode::Stop || !intEnabled || !Config::interrupts || !callbacks.pollInterrupt)
+        return Stop{ StopReason::Halted };
+      // nothing to do until an interrupt arrives
+      if (!skipToInterrupt(1))
+        return Stop{ StopReason::Halted };
+      if (callbacks.pollInterrupt(mem, state))
+        takeInterrupt();
+      else
+        state.cycles++;
+      continue;
+    }
+
     auto addr = realAddr(registers.cs, registers.ip);
+    [[maybe_unused]] auto insnIp = registers.ip;
+    if (Config::hooks && traces) {
+      // only enter a trace if the budget allows at least one pass of it
+      auto remaining = options.budget ? options.budget - steps + 1 : 0;
+      if (auto const* trace = traces->find(static_cast<u16>(addr)); trace && (!remaining || remaining >= trace->ops.size())) {
+        auto exit = traces->run(*trace, mem, state, callbacks, options, remaining);
+        steps += exit.retired - 1;
+        if (exit.interrupt)
+          takeInterrupt();
+        syncPmu();
+        continue;
+      }
+    }
+    if constexpr (Config::debug) {
+      if (options.coverage) {
+        auto& map = *options.coverage;
+        map[((prevAddr >> 1) ^ addr) & (map.size() - 1)]++;
+        prevAddr = static_cast<u16>(addr);
+      }
+      if (breakpoints && !resuming && breakpoints->execute.test(registers.cs, insnIp))
+        return Stop{ StopReason::Breakpoint, static_cast<u16>(addr) };
+      resuming = false;
+    }
+
     auto disasm = Instruction::disassemble(std::span{&mem.direct[addr], static_cast<std::size_t>((256*256)-addr)});
     setIP(disasm.continueFrom.data() - &mem.direct[0]);
     if (!disasm) {
@@ -47,15 +363,32 @@ void daisa::interpreter::interpret(
         case FailureReason::InvalidArgument:
         case FailureReason::NoData:
           // TODO: do something more fun on disassembly failure
-          halt = true;
-          continue;
+          setIP(addr); // leave ip at the bad instruction
+          if (pmu)
+            pmu->invalidInstruction();
+          return Stop{ StopReason::InvalidInstruction, static_cast<u16>(addr) };
         case FailureReason::None:
           // this should never be reached
           break;
       }
     }
 
+    if (pmu && registers.cs != (addr >> 8))
+      pmu->crossedSegment();
+
     auto insn = *disasm.instruction;
+    state.cycles += cycle_table[mem.direct[addr]];
+    state.retired++;
+    // checked only by the extension's own cases, to keep it off every other instruction's path
+    auto invalidExtension = [&] {
+      state.cycles -= cycle_table[mem.direct[addr]];
+      state.retired--;
+      setIP(addr);
+      if (pmu)
+        pmu->invalidInstruction();
+      return Stop{ StopReason::InvalidInstruction, static_cast<u16>(addr) };
+    };
+
     auto regArg = [&]() -> decltype(auto) {
       return registers.addressable[static_cast<u8>(insn.reg_argument())];
     };
@@ -67,7 +400,7 @@ void daisa::interpreter::interpret(
       }
     };
 
-    auto regAddr = [&]() -> decltype(auto) {
+    auto regAddr = [&](StopReason access) -> decltype(auto) {
       auto off = getArg();
       auto seg = [&] {
         if (auto reg = insn.reg_argument(); reg == Register::SP || reg == Register::BP) {
@@ -76,20 +409,10 @@ void daisa::interpreter::interpret(
           return registers.ds;
         }
       }();
+      watch(access, seg, off);
       return mem.paged[seg][off];
     };
 
-    auto pushStack = [&](u8 val) {
-      mem.paged[registers.ss][registers.named.sp] = val;
-      if (registers.named.sp++ == 0xff)
-        registers.ss++;
-    };
-    auto popStack = [&]() {
-      if (registers.named.sp-- == 0xff)
-        registers.ss--;
-      return mem.paged[registers.ss][registers.named.sp];
-    };
-
     auto updateFlags = [&](u8 val) {
       registers.flags.z = val == 0;
       registers.flags.n = (val & 0x80) != 0;
@@ -122,10 +445,20 @@ void daisa::interpreter::interpret(
         // cs <- a, ip <- r
         registers.cs = registers.a;
         registers.ip = getArg();
+        if (pmu)
+          pmu->farJump();
+        syncPmu();
         break;
       case OpCode::JN:
         // ip <- r
         registers.ip = getArg();
+        syncPmu();
+        if constexpr (Config::hooks) {
+          if (options.skipIdleLoops)
+            checkIdleLoop(insnIp);
+          if (traces && registers.ip <= insnIp)
+            traces->jumpedTo(mem, static_cast<u16>(realAddr(registers.cs, registers.ip)), options);
+        }
         break;
       case OpCode::Jc:
         { // conditional near jump to immediate
@@ -141,8 +474,16 @@ void daisa::interpreter::interpret(
               default: assert(false); __builtin_unreachable();
             }
           }();
-          if (value ^ negated)
+          if (value ^ negated) {
             registers.ip = insn.immedidate();
+            syncPmu();
+            if constexpr (Config::hooks) {
+              if (options.skipIdleLoops)
+                checkIdleLoop(insnIp);
+              if (traces && registers.ip <= insnIp)
+                traces->jumpedTo(mem, static_cast<u16>(realAddr(registers.cs, registers.ip)), options);
+            }
+          }
         }
         break;
 
@@ -152,6 +493,7 @@ void daisa::interpreter::interpret(
           auto tmp = registers.ip;
           registers.ip = getArg();
           registers.named.lr = tmp;
+          syncPmu();
         }
         break;
       case OpCode::CALLF:
@@ -161,11 +503,15 @@ void daisa::interpreter::interpret(
           auto tmp = registers.ip;
           registers.ip = getArg();
           registers.named.lr = tmp;
+          if (pmu)
+            pmu->farJump();
+          syncPmu();
         }
         break;
       case OpCode::RET:
         registers.cs = registers.csr;
         registers.ip = registers.named.lr;
+        syncPmu();
         break;
 
       case OpCode::PUSH:
@@ -208,10 +554,10 @@ void daisa::interpreter::interpret(
         regArg() = registers.a;
         break;
       case OpCode::LDM:
-        registers.a = regAddr();
+        registers.a = load(regAddr(StopReason::ReadWatchpoint));
         break;
       case OpCode::STM:
-        regAddr() = registers.a;
+        store(regAddr(StopReason::WriteWatchpoint), registers.a);
         break;
 
       case OpCode::SWP:
@@ -288,34 +634,99 @@ void daisa::interpreter::interpret(
         registers.flags = {};
         break;
 
+      // the extended arithmetic set works on r1:a and r3:r2 as 16-bit pairs, with the high byte in the register
+      case OpCode::MUL:
+        if (!options.extendedArithmetic)
+          return invalidExtension();
+        {
+          auto product = static_cast<u16>(registers.a * registers.named.r1);
+          registers.a = static_cast<u8>(product & 0xff);
+          registers.named.r1 = static_cast<u8>(product >> 8);
+          registers.flags.z = product == 0;
+          registers.flags.n = (product & 0x8000) != 0;
+          registers.flags.c = registers.flags.o = registers.named.r1 != 0;
+        }
+        break;
+      case OpCode::DIV:
+      case OpCode::MOD:
+        if (!options.extendedArithmetic)
+          return invalidExtension();
+        // dividing by zero leaves a alone, and sets carry
+        registers.flags.c = registers.named.r1 == 0;
+        registers.flags.o = false;
+        if (registers.named.r1 != 0) {
+          registers.a = insn.opcode() == OpCode::DIV
+            ? static_cast<u8>(registers.a / registers.named.r1)
+            : static_cast<u8>(registers.a % registers.named.r1);
+        }
+        updateFlags(registers.a);
+        break;
+      case OpCode::ADDW:
+      case OpCode::SUBW:
+        if (!options.extendedArithmetic)
+          return invalidExtension();
+        {
+          auto x = static_cast<u16>((registers.named.r1 << 8) | registers.a);
+          auto y = static_cast<u16>((registers.named.r3 << 8) | registers.named.r2);
+          bool add = insn.opcode() == OpCode::ADDW;
+          auto result = static_cast<u16>(add ? x + y : x - y);
+          registers.a = static_cast<u8>(result & 0xff);
+          registers.named.r1 = static_cast<u8>(result >> 8);
+          registers.flags.z = result == 0;
+          registers.flags.n = (result & 0x8000) != 0;
+          registers.flags.c = add ? result < x : y > x;
+          registers.flags.o = ((add ? ~(x ^ y) : (x ^ y)) & (x ^ result) & 0x8000) != 0;
+        }
+        break;
+
       case OpCode::ENI:
         queueIntEnable = true;
         break;
       case OpCode::DSI:
+        if (pmu && intEnabled)
+          pmu->masked(state.cycles);
         intEnabled = false;
         break;
       case OpCode::IRET:
         registers.ip = popStack();
         registers.cs = popStack();
         queueIntEnable = true;
+        syncPmu();
         break;
       case OpCode::HLT:
-        halt = true;
+        state.halted = true;
         continue;
+
+      case OpCode::HCALL:
+        if (options.deferHostCalls)
+          return Stop{ StopReason::HostCall, static_cast<u16>(addr) };
+        registers.a = serviceHostCalls(mem, registers.ds, registers.a, callbacks, options);
+        wroteMemory = true;
+        break;
     }
 
     // check for an interrupt after each instruction
-    if (intEnabled && pollInterrupt(mem, registers)) {
-      auto seg = mem.paged[0xff][0xfe];
-      auto off = mem.paged[0xff][0xff];
-      intEnabled = false;
-      pushStack(registers.cs);
-      pushStack(registers.ip);
-      registers.cs = seg;
-      registers.ip = off;
+    if constexpr (Config::interrupts) {
+      if (intEnabled && callbacks.pollInterrupt && callbacks.pollInterrupt(mem, state))
+        takeInterrupt();
     }
 
-    if (queueIntEnable)
+    if (queueIntEnable) {
+      if (pmu && !intEnabled)
+        pmu->unmasked(state.cycles);
       intEnabled = true;
+    }
+
+    // only stop for a watchpoint after polling, so that interrupts arrive at the same points whether or not
+    //   anything is watched
+    if constexpr (Config::debug) {
+      if (watchHit)
+        return *watchHit;
+    }
   }
 }
+
+template struct daisa::interpreter::Interpreter<FullConfig>;
+template struct daisa::interpreter::Interpreter<HostedConfig>;
+template struct daisa::interpreter::Interpreter<InterruptConfig>;
+template struct daisa::interpreter::Interpreter<BareConfig>;
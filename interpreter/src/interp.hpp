@@ -3,12 +3,186 @@
 #include "types.hpp"
 
 #include <functional>
+#include <optional>
+#include <span>
 
 namespace daisa::interpreter {
-  
+
+  class TraceCache;
+  class Pmu;
+
+  enum class HaltMode {
+    /// hlt stops interpretation
+    Stop,
+    /// hlt waits for the next interrupt, stopping only if interrupts are disabled, none is scheduled, or there
+    ///   is no pollInterrupt callback to deliver one
+    WaitForInterrupt,
+  };
+
+  struct Options {
+    HaltMode haltMode = HaltMode::Stop;
+    /// detect loops which cannot make progress until an interrupt arrives, and skip ahead to it;
+    ///   only valid if nothing else writes to memory while interpreting
+    bool skipIdleLoops = false;
+    /// memory is written concurrently by other threads, so data accesses must be atomic;
+    ///   instruction fetches are not, so code must not be modified while another core may run it
+    bool sharedMemory = false;
+    /// if set, stop at its execution breakpoints and data watchpoints
+    Breakpoints const* breakpoints = nullptr;
+    /// don't stop at a breakpoint on the first instruction, so that we can continue after stopping at one
+    bool stepOverBreakpoint = false;
+    /// stop after this many instructions (or idle cycles while halted); 0 for no limit
+    u64 budget = 0;
+    /// if set, pages written to by the guest are marked in it
+    PageMask* dirtyPages = nullptr;
+    /// if set, a hit count is incremented for each edge between consecutively executed instructions
+    CoverageMap* coverage = nullptr;
+    /// stop after each hcall instead of servicing it, so that the host can do it with serviceHostCalls later
+    bool deferHostCalls = false;
+    /// if set, hot loops are compiled into traces kept in it, and run from there; not used with breakpoints,
+    ///   coverage, sharedMemory or skipIdleLoops
+    TraceCache* traces = nullptr;
+    /// if set, the guest's stores to these pages are passed to Callbacks::mmioWrite
+    PageMask const* mmioPages = nullptr;
+    /// execute the extended arithmetic instructions (mul, div, mod, addw and subw), which are otherwise invalid
+    bool extendedArithmetic = false;
+    /// if set, performance counters are kept in it
+    Pmu* pmu = nullptr;
+  };
+
+  enum class StopReason {
+    /// halted, with nothing left to wait for
+    Halted,
+    /// failed to decode the instruction at the address, which is left in cs:ip
+    InvalidInstruction,
+    /// about to execute the instruction at the address
+    Breakpoint,
+    /// the last instruction read from the address
+    ReadWatchpoint,
+    /// the last instruction wrote to the address
+    WriteWatchpoint,
+    /// ran for the number of steps in Options::budget
+    BudgetExhausted,
+    /// the instruction at the address was an hcall, which was left for the host with Options::deferHostCalls
+    HostCall,
+  };
+
+  struct Stop {
+    StopReason reason;
+    u16 address = 0;
+  };
+
+  /// a service requested by one hcall descriptor
+  enum class HostService : u8 {
+    /// ends the request list
+    End = 0,
+    /// writes the buffer to the channel
+    Write = 1,
+    /// reads up to the length of the buffer from the channel
+    Read = 2,
+    /// fills the buffer with the host's wall clock time, in microseconds since the Unix epoch, little-endian
+    Time = 3,
+  };
+
+  struct HostCall {
+    HostService service;
+    u8 channel;
+  };
+
+  /// size of one hcall descriptor in guest memory
+  inline constexpr u8 host_call_size = 8;
+
+  struct Callbacks {
+    /// checked after each instruction while interrupts are enabled; returns whether to raise an interrupt
+    std::function<bool(Memory const&, CpuState const&)> pollInterrupt = {};
+    /// gets the cycle count at which the next interrupt will be raised, or nothing if none is scheduled;
+    /// if not set, idle time is never skipped
+    std::function<std::optional<u64>(CpuState const&)> nextInterrupt = {};
+    /// services one request from an hcall list, given its buffer; returns the number of bytes transferred,
+    ///   or nothing if it failed; if not set, every request fails
+    std::function<std::optional<u16>(HostCall const&, std::span<u8>)> hostCall = {};
+    /// called after the guest stores a value to an address in Options::mmioPages, so that a device can act on it;
+    ///   the device may change any of memory, but must mark the pages it changes in the mask
+    std::function<void(Memory&, u16, u8, PageMask&)> mmioWrite = {};
+  };
+
+  /// @brief Services the hcall request list at seg:off, as hcall does.
+  /// @return The number of requests that failed, which hcall puts in the accumulator.
+  u8 serviceHostCalls(
+    Memory& mem,
+    u8 seg,
+    u8 off,
+    Callbacks const& callbacks,
+    Options const& options = {});
+
+  /// @brief Passes a store by the guest to Callbacks::mmioWrite, and then marks the pages it changed as written.
+  void mmioWrite(
+    Memory& mem,
+    u16 addr,
+    u8 val,
+    Callbacks const& callbacks,
+    Options const& options);
+
+  /// @brief The optional features compiled into an Interpreter. Each one left out takes its checks out of the loop,
+  ///   so the interpreter can only run with Options and Callbacks which don't ask for it.
+  template <bool Debug, bool SharedMemory, bool Interrupts, bool Hooks>
+  struct InterpreterConfig {
+    /// Options::breakpoints and Options::coverage
+    static constexpr bool debug = Debug;
+    /// Options::sharedMemory
+    static constexpr bool sharedMemory = SharedMemory;
+    /// Callbacks::pollInterrupt
+    static constexpr bool interrupts = Interrupts;
+    /// Options::budget, dirtyPages, traces, mmioPages, skipIdleLoops and pmu
+    static constexpr bool hooks = Hooks;
+
+    /// @brief Whether an interpreter with this config can run with the options and callbacks.
+    [[nodiscard]] static bool supports(Options const& options, Callbacks const& callbacks) noexcept {
+      return (debug || (!options.breakpoints && !options.coverage))
+        && (sharedMemory || !options.sharedMemory)
+        && (interrupts || !callbacks.pollInterrupt)
+        && (hooks || (!options.budget && !options.dirtyPages && !options.traces && !options.mmioPages
+          && !options.skipIdleLoops && !options.pmu));
+    }
+  };
+
+  /// every feature, for debuggers and multi-core systems
+  using FullConfig = InterpreterConfig<true, true, true, true>;
+  /// interrupts and the host's hooks, as used by the scheduler, checkpoints and traces
+  using HostedConfig = InterpreterConfig<false, false, true, true>;
+  /// interrupts only
+  using InterruptConfig = InterpreterConfig<false, false, true, false>;
+  /// nothing optional: the loop only decodes and executes
+  using BareConfig = InterpreterConfig<false, false, false, false>;
+
+  /// @brief The interpreter loop, compiled with only the features in Config.
+  /// @note Only the configs above are compiled.
+  template <typename Config>
+  struct Interpreter {
+    /// @brief Runs as interpret does, with options and callbacks which Config supports.
+    static Stop run(Memory& mem, CpuState& state, Callbacks const& callbacks, Options const& options);
+  };
+
+  extern template struct Interpreter<FullConfig>;
+  extern template struct Interpreter<HostedConfig>;
+  extern template struct Interpreter<InterruptConfig>;
+  extern template struct Interpreter<BareConfig>;
+
+  using InterpreterFn = Stop (*)(Memory&, CpuState&, Callbacks const&, Options const&);
+
+  /// @brief Picks the smallest compiled interpreter which supports the options and callbacks.
+  [[nodiscard]] InterpreterFn selectInterpreter(Options const& options, Callbacks const& callbacks) noexcept;
+
+  /// @brief Runs until something stops it, with the interpreter selectInterpreter picks.
+  Stop interpret(
+    Memory& mem,
+    CpuState& state,
+    Callbacks const& callbacks,
+    Options options = {});
+
   void interpret(
     Memory& mem,
     u16 startAddr,
     std::function<bool(Memory const&, RegisterPage const&)> pollInterrupt);
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,1070 @@
+#include "types.hpp"
+#include "interp.hpp"
+#include "system.hpp"
+#include "checkpoint.hpp"
+#include "pagepool.hpp"
+#include "scheduler.hpp"
+#include "history.hpp"
+#include "trace.hpp"
+#include "banks.hpp"
+#include "dma.hpp"
+#include "pmu.hpp"
+#include "gdb.hpp"
+
+#include <daisa.hpp>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <array>
+#include <span>
+#include <stdexcept>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+namespace {
+
+  Instruction insn(OpCode op) { return *Instruction::create(op); }
+  Instruction insn(OpCode op, Register reg) { return *Instruction::create(op, reg); }
+  Instruction insn(OpCode op, u8 imm) { return *Instruction::create(op, imm); }
+  Instruction insn(OpCode op, Condition cond, u8 imm) { return *Instruction::create(op, cond, imm); }
+
+  void load(Memory& mem, u8 seg, std::span<Instruction const> insns) {
+    mem.paged[seg] = assemble_segment(insns).output;
+  }
+
+  // sets up an interrupt routine at 01:00 which writes 1 to 20:10, then enables interrupts
+  //   and leaves ds at 0x20; ends at 00:12
+  void load_interrupt_setup(Memory& mem, std::span<Instruction const> body) {
+    std::array<Instruction, 11> setup{
+      insn(OpCode::DSI),
+      insn(OpCode::LDDS, (u8)0xff),
+      insn(OpCode::LDA, (u8)0x01),
+      insn(OpCode::STM, (u8)0xfe),
+      insn(OpCode::LDA, (u8)0x00),
+      insn(OpCode::STM, (u8)0xff),
+      insn(OpCode::LDSS, (u8)0x80),
+      insn(OpCode::CLR),
+      insn(OpCode::STA, Register::SP),
+      insn(OpCode::LDDS, (u8)0x20),
+      insn(OpCode::ENI),
+    };
+    load(mem, 0x00, setup);
+    auto rest = assemble_segment(body).output;
+    std::copy(rest.begin(), rest.end() - 0x12, mem.paged[0x00].begin() + 0x12);
+
+    std::array handler{
+      insn(OpCode::LDA, (u8)0x01),
+      insn(OpCode::STM, (u8)0x10),
+      insn(OpCode::IRET),
+    };
+    load(mem, 0x01, handler);
+  }
+
+}
+
+bool cycles_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::LDA, (u8)0x01), // 2
+    insn(OpCode::LDM, Register::R1), // 2
+    insn(OpCode::NOP), // 1
+    insn(OpCode::HLT), // 1
+  };
+  load(*mem, 0x00, program);
+
+  CpuState state;
+  interpret(*mem, state, Callbacks{});
+  return state.halted
+    && state.retired == 4
+    && state.cycles == 6;
+}
+
+bool idle_skip_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array body{
+    insn(OpCode::LDM, (u8)0x10),
+    insn(OpCode::AND, (u8)0x01),
+    insn(OpCode::Jc, Condition::Zero, 0x12),
+    insn(OpCode::HLT),
+  };
+  load_interrupt_setup(*mem, body);
+
+  constexpr u64 timer = 100000;
+  bool fired = false;
+  u64 polls = 0;
+  CpuState state;
+  interpret(*mem, state, Callbacks{
+    .pollInterrupt = [&](Memory const&, CpuState const& state) {
+      polls++;
+      if (fired || state.cycles < timer)
+        return false;
+      return fired = true;
+    },
+    .nextInterrupt = [&](CpuState const&) -> std::optional<u64> {
+      if (fired) return std::nullopt;
+      return timer;
+    },
+  }, Options{ .skipIdleLoops = true });
+
+  return fired
+    && state.halted
+    && mem->paged[0x20][0x10] == 1
+    && state.cycles >= timer && state.cycles < timer + 32
+    && polls < 32;
+}
+
+bool halt_wait_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array body{
+    insn(OpCode::HLT),
+    insn(OpCode::LDM, (u8)0x10),
+    insn(OpCode::HLT),
+  };
+  load_interrupt_setup(*mem, body);
+
+  constexpr u64 timer = 5000;
+  bool fired = false;
+  u64 polls = 0;
+  CpuState state;
+  interpret(*mem, state, Callbacks{
+    .pollInterrupt = [&](Memory const&, CpuState const& state) {
+      polls++;
+      if (fired || state.cycles < timer)
+        return false;
+      return fired = true;
+    },
+    .nextInterrupt = [&](CpuState const&) -> std::optional<u64> {
+      if (fired) return std::nullopt;
+      return timer;
+    },
+  }, Options{ .haltMode = HaltMode::WaitForInterrupt });
+
+  // with no callbacks, nothing can ever interrupt the first hlt
+  CpuState unwoken;
+  auto stop = interpret(*mem, unwoken, Callbacks{}, Options{ .haltMode = HaltMode::WaitForInterrupt });
+  // nor with only nextInterrupt, which schedules interrupts but can't deliver them
+  CpuState scheduled;
+  auto scheduledStop = interpret(*mem, scheduled, Callbacks{
+    .nextInterrupt = [](CpuState const&) -> std::optional<u64> { return 100; },
+  }, Options{ .haltMode = HaltMode::WaitForInterrupt });
+
+  // the second hlt has nothing left to wait for, so interpretation stops there
+  return fired
+    && stop.reason == StopReason::Halted && unwoken.halted && unwoken.registers.a == 0
+    && scheduledStop.reason == StopReason::Halted && scheduled.halted && scheduled.registers.a == 0
+    && state.halted
+    && state.registers.a == 1
+    && state.cycles >= timer && state.cycles < timer + 32
+    && polls < 32;
+}
+
+bool multicore_ipi_test() {
+  auto mem = std::make_unique<Memory>();
+  // core 0 publishes a value, then interrupts core 1 through its mailbox
+  std::array sender{
+    insn(OpCode::DSI),
+    insn(OpCode::LDDS, (u8)0x20),
+    insn(OpCode::LDA, (u8)0x42),
+    insn(OpCode::STM, (u8)0x00),
+    insn(OpCode::LDDS, (u8)0xff),
+    insn(OpCode::LDA, (u8)0x01),
+    insn(OpCode::STM, (u8)0xf1),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x00, sender);
+  // core 1 waits for the interrupt, and its handler copies the value
+  std::array receiver{
+    insn(OpCode::DSI),
+    insn(OpCode::LDDS, (u8)0xff),
+    insn(OpCode::LDA, (u8)0x03),
+    insn(OpCode::STM, (u8)0xfe),
+    insn(OpCode::LDA, (u8)0x00),
+    insn(OpCode::STM, (u8)0xff),
+    insn(OpCode::LDSS, (u8)0x80),
+    insn(OpCode::CLR),
+    insn(OpCode::STA, Register::SP),
+    insn(OpCode::ENI),
+    insn(OpCode::HLT),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x02, receiver);
+  std::array handler{
+    insn(OpCode::LDDS, (u8)0x20),
+    insn(OpCode::LDM, (u8)0x00),
+    insn(OpCode::STM, (u8)0x01),
+    insn(OpCode::IRET),
+  };
+  load(*mem, 0x03, handler);
+
+  System system(*mem, 2);
+  system.state(1).registers.cs = 0x02;
+  system.run(Callbacks{}, Options{ .haltMode = HaltMode::WaitForInterrupt });
+
+  bool delivered = system.state(0).halted
+    && system.state(1).halted
+    && system.state(1).registers.named.r1 == 1
+    && mem->paged[0x20][0x01] == 0x42
+    && mem->paged[0xff][0xf1] == 0;
+
+  // both cores wait with interrupts enabled, but neither will ever interrupt the other
+  std::array idle{ insn(OpCode::ENI), insn(OpCode::HLT) };
+  load(*mem, 0x04, idle);
+  System waiters(*mem, 2);
+  waiters.state(0).registers.cs = waiters.state(1).registers.cs = 0x04;
+  waiters.run(Callbacks{}, Options{ .haltMode = HaltMode::WaitForInterrupt });
+
+  // cores can't share anything they write to
+  PageMask dirty;
+  try {
+    waiters.run(Callbacks{}, Options{ .dirtyPages = &dirty });
+    return false;
+  } catch (std::invalid_argument const&) {}
+  TraceCache cache(2);
+  try {
+    waiters.run(Callbacks{}, Options{ .traces = &cache });
+    return false;
+  } catch (std::invalid_argument const&) {}
+
+  return delivered && waiters.state(0).halted && waiters.state(1).halted;
+}
+
+bool breakpoints_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::LDDS, (u8)0x20), // 00:00
+    insn(OpCode::LDA, (u8)0x05), // 00:02
+    insn(OpCode::STM, (u8)0x10), // 00:04
+    insn(OpCode::LDM, (u8)0x11), // 00:06
+    insn(OpCode::NOP), // 00:08
+    insn(OpCode::HLT), // 00:09
+  };
+  load(*mem, 0x00, program);
+
+  Breakpoints breakpoints;
+  breakpoints.execute.set(0x0008);
+  breakpoints.write.set(0x2010);
+  breakpoints.read.set(0x2011);
+  breakpoints.execute.set(0x1234);
+  breakpoints.execute.reset(0x1234);
+  if (breakpoints.execute.flagged[0x12]) return false;
+
+  CpuState state;
+  auto options = Options{ .breakpoints = &breakpoints };
+  auto stop = interpret(*mem, state, Callbacks{}, options);
+  if (stop.reason != StopReason::WriteWatchpoint || stop.address != 0x2010) return false;
+  if (state.registers.ip != 0x06 || mem->paged[0x20][0x10] != 0x05) return false;
+
+  stop = interpret(*mem, state, Callbacks{}, options);
+  if (stop.reason != StopReason::ReadWatchpoint || stop.address != 0x2011) return false;
+
+  stop = interpret(*mem, state, Callbacks{}, options);
+  if (stop.reason != StopReason::Breakpoint || stop.address != 0x0008) return false;
+  if (state.registers.ip != 0x08 || state.retired != 4) return false;
+
+  options.budget = 1;
+  options.stepOverBreakpoint = true;
+  stop = interpret(*mem, state, Callbacks{}, options);
+  if (stop.reason != StopReason::BudgetExhausted || state.registers.ip != 0x09) return false;
+
+  stop = interpret(*mem, state, Callbacks{}, Options{});
+  return stop.reason == StopReason::Halted && state.retired == 6;
+}
+
+bool stack_wrap_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::PUSH, (u8)0xaa),
+    insn(OpCode::PUSH, (u8)0xbb),
+    insn(OpCode::POP, Register::R1),
+    insn(OpCode::POP, Register::R2),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x00, program);
+
+  CpuState state;
+  state.registers.ss = 0x10;
+  state.registers.named.sp = 0xff;
+  interpret(*mem, state, Callbacks{});
+
+  // the pushes straddle 10:ff and 11:00, and the pops must come back across the same boundary
+  return mem->paged[0x10][0xff] == 0xaa
+    && mem->paged[0x11][0x00] == 0xbb
+    && state.registers.named.r1 == 0xbb
+    && state.registers.named.r2 == 0xaa
+    && state.registers.ss == 0x10
+    && state.registers.named.sp == 0xff;
+}
+
+bool hostcall_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::LDDS, (u8)0x20),
+    insn(OpCode::CLR),
+    insn(OpCode::HCALL),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x00, program);
+
+  std::string text = "hello world";
+  std::copy(text.begin(), text.end(), mem->paged[0x30].begin());
+  std::array<std::array<u8, host_call_size>, 5> requests{{
+    { 1, 1, 0x30, 0x00, 6, 0 },  // write "hello "
+    { 1, 1, 0x30, 0x06, 5, 0 },  // write "world"
+    { 3, 0, 0x30, 0xfc, 8, 0 },  // time, across 30:ff and 31:00
+    { 2, 9, 0x30, 0x20, 4, 0 },  // read from a channel the host doesn't have
+    { 0 },
+  }};
+  for (auto i = 0u; i < requests.size(); i++)
+    std::copy(requests[i].begin(), requests[i].end(), mem->paged[0x20].begin() + i * host_call_size);
+
+  std::string written;
+  int calls = 0;
+  Callbacks callbacks{
+    .hostCall = [&](HostCall const& call, std::span<u8> buffer) -> std::optional<u16> {
+      calls++;
+      switch (call.service) {
+        case HostService::Write:
+          written.append(buffer.begin(), buffer.end());
+          return static_cast<u16>(buffer.size());
+        case HostService::Time:
+          for (auto i = 0u; i < buffer.size(); i++)
+            buffer[i] = static_cast<u8>(i + 1);
+          return static_cast<u16>(buffer.size());
+        default:
+          return std::nullopt;
+      }
+    },
+  };
+
+  CpuState state;
+  PageMask dirty;
+  interpret(*mem, state, callbacks, Options{ .dirtyPages = &dirty });
+
+  auto const& list = mem->paged[0x20];
+  return written == "hello world"
+    && calls == 4
+    && state.registers.a == 1
+    && list[0 * host_call_size + 4] == 6 && list[0 * host_call_size + 6] == 0
+    && list[2 * host_call_size + 4] == 8 && list[2 * host_call_size + 6] == 0
+    && list[3 * host_call_size + 4] == 0 && list[3 * host_call_size + 6] == 1
+    && mem->paged[0x30][0xfc] == 1 && mem->paged[0x31][0x03] == 8
+    && dirty[0x30] && dirty[0x31];
+}
+
+bool checkpoint_test() {
+  auto path = (std::filesystem::temp_directory_path() / "daisa_checkpoint_test.bin").string();
+  auto mem = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::LDDS, (u8)0x40),
+    insn(OpCode::LDA, (u8)0x11),
+    insn(OpCode::STM, (u8)0x00),
+    insn(OpCode::LDDS, (u8)0x41),
+    insn(OpCode::LDA, (u8)0x22),
+    insn(OpCode::STM, (u8)0x05),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x00, program);
+  mem->paged[0x80][0x80] = 0x33;
+
+  CpuState state;
+  PageMask dirty;
+  CpuState afterFirst;
+  {
+    CheckpointWriter writer(path);
+    writer.checkpoint(*mem, state, dirty);
+    interpret(*mem, state, Callbacks{}, Options{ .budget = 3, .dirtyPages = &dirty });
+    afterFirst = state;
+    writer.checkpoint(*mem, state, dirty);
+    interpret(*mem, state, Callbacks{}, Options{ .dirtyPages = &dirty });
+    writer.checkpoint(*mem, state, dirty);
+    if (!writer.flush()) return false;
+  }
+
+  // a full image, then one page for each delta
+  constexpr auto record = 8 + 32 + 32;
+  if (std::filesystem::file_size(path) != 16 + (record + 256*256) + 2 * (record + 256)) return false;
+
+  auto restored = std::make_unique<Memory>();
+  CpuState restoredState;
+  if (!restoreCheckpoint(path, *restored, restoredState)) return false;
+  if (std::memcmp(restored.get(), mem.get(), sizeof(Memory)) != 0) return false;
+  if (std::memcmp(&restoredState.registers, &state.registers, sizeof(RegisterPage)) != 0
+    || restoredState.halted != state.halted || restoredState.cycles != state.cycles
+    || restoredState.retired != state.retired)
+    return false;
+
+  // losing the end of the last record falls back to the one before it
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 10);
+  restored = std::make_unique<Memory>();
+  if (!restoreCheckpoint(path, *restored, restoredState)) return false;
+  std::filesystem::remove(path);
+  return restored->paged[0x40][0x00] == 0x11
+    && restored->paged[0x41][0x05] == 0x00
+    && restored->paged[0x80][0x80] == 0x33
+    && restoredState.retired == afterFirst.retired
+    && restoredState.registers.ip == afterFirst.registers.ip;
+}
+
+bool page_pool_test() {
+  auto image = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::LDDS, (u8)0x20),
+    insn(OpCode::LDA, Register::R1),
+    insn(OpCode::STM, (u8)0x00),
+    insn(OpCode::HLT),
+  };
+  load(*image, 0x00, program);
+  image->paged[0x40][0x00] = 0xaa;
+
+  // the program and data in the first group of pages are shared, while everything else is private
+  PagePool pool(2);
+  PageMask shared;
+  for (auto page = 0u; page < pool.groupPages(); page++)
+    shared[page] = true;
+
+  auto first = pool.create(*image, shared);
+  auto second = pool.create(*image, shared);
+  if (!first || !second || pool.create(*image, shared)) return false;
+  if (pool.sharedGroups() != 1) return false;
+  if (std::memcmp(&first.memory(), image.get(), sizeof(Memory)) != 0) return false;
+
+  CpuState state;
+  state.registers.named.r1 = 0x11;
+  interpret(first.memory(), state, Callbacks{});
+  state = CpuState();
+  state.registers.named.r1 = 0x22;
+  interpret(second.memory(), state, Callbacks{});
+  first.memory().paged[0x00][0xff] = 0x33; // copies the shared group for this guest only
+
+  if (first.memory().paged[0x20][0x00] != 0x11 || second.memory().paged[0x20][0x00] != 0x22) return false;
+  if (second.memory().paged[0x00][0xff] != 0x00 || first.memory().paged[0x40][0x00] != 0xaa) return false;
+
+  first = {};
+  second = {};
+  if (pool.sharedGroups() != 0) return false;
+  auto reused = pool.create(*image, PageMask());
+  return reused && std::memcmp(&reused.memory(), image.get(), sizeof(Memory)) == 0;
+}
+
+bool scheduler_test() {
+  Scheduler scheduler(16);
+
+  // counts to 200 in r1 over several time slices, then stops
+  auto counter = std::make_unique<Memory>();
+  std::array counterProgram{
+    insn(OpCode::LDA, (u8)200),
+    insn(OpCode::STA, Register::R2),
+    insn(OpCode::INC, Register::R1), // 00:03
+    insn(OpCode::DEC, Register::R2),
+    insn(OpCode::Jc, Condition::NotZero, 0x03),
+    insn(OpCode::DSI),
+    insn(OpCode::HLT),
+  };
+  load(*counter, 0x00, counterProgram);
+
+  // reads two bytes from channel 0, then writes them to channel 1
+  auto echo = std::make_unique<Memory>();
+  std::array echoProgram{
+    insn(OpCode::LDDS, (u8)0x30),
+    insn(OpCode::CLR),
+    insn(OpCode::HCALL),
+    insn(OpCode::LDA, (u8)0x10),
+    insn(OpCode::HCALL),
+    insn(OpCode::DSI),
+    insn(OpCode::HLT),
+  };
+  load(*echo, 0x00, echoProgram);
+  std::array<u8, 8> readRequest{ 2, 0, 0x30, 0x80, 2, 0 };
+  std::array<u8, 8> writeRequest{ 1, 1, 0x30, 0x80, 2, 0 };
+  std::copy(readRequest.begin(), readRequest.end(), echo->paged[0x30].begin());
+  std::copy(writeRequest.begin(), writeRequest.end(), echo->paged[0x30].begin() + 0x10);
+
+  // waits for an interrupt, whose handler writes 1 to 20:10
+  auto sleeper = std::make_unique<Memory>();
+  std::array sleeperBody{
+    insn(OpCode::HLT),
+    insn(OpCode::DSI),
+    insn(OpCode::HLT),
+  };
+  load_interrupt_setup(*sleeper, sleeperBody);
+
+  std::string written;
+  Callbacks echoCallbacks{
+    .hostCall = [&](HostCall const& call, std::span<u8> buffer) -> std::optional<u16> {
+      if (call.service != HostService::Write || call.channel != 1)
+        return std::nullopt;
+      written.append(buffer.begin(), buffer.end());
+      return static_cast<u16>(buffer.size());
+    },
+  };
+
+  auto& counterGuest = scheduler.spawn(*counter, CpuState());
+  auto& echoGuest = scheduler.spawn(*echo, CpuState(), echoCallbacks);
+  auto& sleeperGuest = scheduler.spawn(*sleeper, CpuState());
+
+  if (scheduler.run() != 2) return false;
+  if (!counterGuest.finished() || counterGuest.state().registers.named.r1 != 200) return false;
+  if (echoGuest.finished() || sleeperGuest.finished() || !sleeperGuest.state().halted) return false;
+
+  std::array<u8, 2> input{ 'h', 'i' };
+  scheduler.send(echoGuest, 0, input);
+  scheduler.interrupt(sleeperGuest);
+  if (scheduler.run() != 0) return false;
+
+  return written == "hi"
+    && echoGuest.state().registers.a == 0
+    && echoGuest.stop()->reason == StopReason::Halted
+    && sleeper->paged[0x20][0x10] == 1;
+}
+
+bool history_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array body{
+    insn(OpCode::LDA, (u8)50), // 00:12
+    insn(OpCode::STA, Register::R2),
+    insn(OpCode::CLR),
+    insn(OpCode::INC_A), // 00:16
+    insn(OpCode::STM, (u8)0x20),
+    insn(OpCode::DEC, Register::R2),
+    insn(OpCode::Jc, Condition::NotZero, 0x16),
+    insn(OpCode::LDA, (u8)0x77),
+    insn(OpCode::STM, (u8)0x21), // 00:1e
+    insn(OpCode::DSI),
+    insn(OpCode::HLT),
+  };
+  load_interrupt_setup(*mem, body);
+
+  int polls = 0;
+  Callbacks callbacks{
+    .pollInterrupt = [&](Memory const&, CpuState const& state) {
+      polls++;
+      return state.retired == 100;
+    },
+  };
+
+  CpuState state;
+  Breakpoints breakpoints;
+  PageMask dirty;
+  History history(*mem, state, callbacks, Options{ .breakpoints = &breakpoints, .dirtyPages = &dirty }, 16);
+  if (history.run().reason != StopReason::Halted) return false;
+  // the caller's mask still sees the guest's stores
+  if (!dirty[0x20] || !dirty[0x80] || !dirty[0xff]) return false;
+  dirty.reset();
+  auto final = std::make_unique<Memory>(*mem);
+  auto finalState = state;
+  auto recordedPolls = polls;
+  if (history.snapshotCount() < 10) return false;
+
+  auto writer = history.reverseToLastWrite(0x2021);
+  if (!writer || *writer != finalState.retired - 3 || state.registers.ip != 0x1e || mem->paged[0x20][0x21] != 0)
+    return false;
+  auto value = mem->paged[0x20][0x20];
+  if (!history.reverseToLastWrite(0x2020) || state.registers.ip != 0x17 || mem->paged[0x20][0x20] == value)
+    return false;
+  auto before = state.retired;
+  if (!history.reverseStep() || state.retired != before - 1) return false;
+
+  // back to the end, through the interrupt, without asking the host again
+  if (!history.seek(finalState.retired)) return false;
+  if (std::memcmp(mem.get(), final.get(), sizeof(Memory)) != 0 || state.cycles != finalState.cycles) return false;
+
+  breakpoints.execute.set(0x0100);
+  auto stop = history.reverseContinue();
+  if (!stop || stop->reason != StopReason::Breakpoint || state.registers.cs != 0x01 || state.retired != 100)
+    return false;
+  if (history.run().reason != StopReason::Halted) return false;
+  if (std::memcmp(mem.get(), final.get(), sizeof(Memory)) != 0) return false;
+
+  if (!history.seek(history.start()) || history.reverseStep()) return false;
+  // going back rewrote the page the loop stored to
+  if (!dirty[0x20]) return false;
+
+  // devices and counters keep state snapshots don't hold
+  Pmu pmu(0xe0);
+  try {
+    History withPmu(*mem, state, callbacks, Options{ .pmu = &pmu });
+    return false;
+  } catch (std::invalid_argument const&) {}
+  return polls == recordedPolls;
+}
+
+bool traces_test() {
+  // runs the same program with and without traces, which must agree on everything
+  auto compare = [](Memory const& image, CpuState const& start, Callbacks const& callbacks, u64 budget, u64 chunk,
+    bool extended = false, PageMask const* mmio = nullptr) {
+    auto plain = std::make_unique<Memory>(image);
+    auto traced = std::make_unique<Memory>(image);
+    CpuState plainState = start;
+    CpuState tracedState = start;
+    TraceCache cache(2);
+    auto plainStop = interpret(*plain, plainState, callbacks, Options{ .budget = budget, .mmioPages = mmio,
+      .extendedArithmetic = extended });
+    Stop tracedStop{};
+    for (u64 ran = 0; ran < budget; ran += chunk) {
+      auto slice = std::min(chunk, budget - ran);
+      tracedStop = interpret(*traced, tracedState, callbacks, Options{ .budget = slice, .traces = &cache, .mmioPages = mmio,
+        .extendedArithmetic = extended });
+      if (tracedStop.reason != StopReason::BudgetExhausted)
+        break;
+    }
+    return std::make_pair(plainStop.reason == tracedStop.reason
+      && std::memcmp(plain.get(), traced.get(), sizeof(Memory)) == 0
+      && std::memcmp(&plainState.registers, &tracedState.registers, sizeof(RegisterPage)) == 0
+      && plainState.cycles == tracedState.cycles
+      && plainState.retired == tracedState.retired
+      && plainState.intEnabled == tracedState.intEnabled
+      && plainState.halted == tracedState.halted, cache.size());
+  };
+
+  // a checksum loop which rewrites the immediate of its own add, then a countdown, taking interrupts on the way
+  auto mem = std::make_unique<Memory>();
+  std::array body{
+    insn(OpCode::LDA, (u8)200), // 00:12
+    insn(OpCode::STA, Register::R2),
+    insn(OpCode::CLR),
+    insn(OpCode::ADD, (u8)0x01), // 00:16
+    insn(OpCode::ADC, Register::R2),
+    insn(OpCode::SHL),
+    insn(OpCode::XOR, (u8)0x5a),
+    insn(OpCode::PUSH, Register::R2),
+    insn(OpCode::STM, Register::R2),
+    insn(OpCode::POP, Register::R3),
+    insn(OpCode::SWP, Register::R3),
+    insn(OpCode::LDDS, (u8)0x00),
+    insn(OpCode::STM, (u8)0x17),
+    insn(OpCode::LDDS, (u8)0x20),
+    insn(OpCode::SWP, Register::R3),
+    insn(OpCode::DEC, Register::R2),
+    insn(OpCode::Jc, Condition::NotZero, 0x16),
+    insn(OpCode::LDA, (u8)50), // 00:2a
+    insn(OpCode::DEC_A), // 00:2c
+    insn(OpCode::Jc, Condition::NotZero, 0x2c),
+    insn(OpCode::DSI),
+    insn(OpCode::HLT),
+  };
+  load_interrupt_setup(*mem, body);
+  Callbacks callbacks{
+    .pollInterrupt = [](Memory const&, CpuState const& state) { return state.cycles % 97 == 0; },
+  };
+  for (auto chunk : { u64(100000), u64(7), u64(1) }) {
+    auto [same, traces] = compare(*mem, CpuState{}, callbacks, 100000, chunk);
+    if (!same || (chunk != 1 && traces == 0))
+      return false;
+  }
+
+  // a device store leaves the trace, and on its sixth the device rewrites the add after it into an adc, which
+  //   reads the carry the add before the store set even though the trace had it as dead
+  auto rewritten = std::make_unique<Memory>();
+  std::array device{
+    insn(OpCode::LDDS, (u8)0xe0),
+    insn(OpCode::ADD, (u8)0x80), // 05:02
+    insn(OpCode::STM, (u8)0x00),
+    insn(OpCode::ADD, (u8)0x00), // 05:06
+    insn(OpCode::DEC, Register::R3),
+    insn(OpCode::Jc, Condition::NotZero, 0x02),
+    insn(OpCode::HLT),
+  };
+  load(*rewritten, 0x05, device);
+  PageMask devicePages;
+  devicePages[0xe0] = true;
+  Callbacks rewriter{
+    .mmioWrite = [](Memory& mem, u16, u8, PageMask& changed) {
+      if (++mem.paged[0xe1][0x00] == 6) {
+        mem.paged[0x05][0x06] = insn(OpCode::ADC, (u8)0).encode();
+        changed[0x05] = true;
+      }
+      changed[0xe1] = true;
+    },
+  };
+  CpuState deviceStart;
+  deviceStart.registers.cs = 0x05;
+  deviceStart.registers.named.r3 = 20;
+  if (auto [same, traces] = compare(*rewritten, deviceStart, rewriter, 1000, 1000, false, &devicePages); !same || traces == 0)
+    return false;
+
+  // and random code, which mostly jumps around in segment 0
+  std::mt19937 rng(1);
+  for (auto i = 0; i < 500; i++) {
+    auto image = std::make_unique<Memory>();
+    for (auto& byte : image->paged[0])
+      byte = static_cast<u8>(rng());
+    for (auto& byte : image->paged[0xff])
+      byte = static_cast<u8>(rng() & 0x3f);
+    auto period = 1 + rng() % 64;
+    Callbacks random{
+      .pollInterrupt = [period](Memory const&, CpuState const& state) { return state.retired % period == 0; },
+    };
+    CpuState start;
+    start.intEnabled = i % 2 == 0;
+    if (!compare(*image, start, random, 5000, 5000, i % 3 == 0).first)
+      return false;
+  }
+  return true;
+}
+
+bool banks_test() {
+  auto mem = std::make_unique<Memory>();
+  Banks banks(*mem, 0xf0);
+  banks.contents(0x1234)[0x05] = 0x99;
+
+  std::array program{
+    insn(OpCode::LDDS, (u8)0x40),
+    insn(OpCode::LDA, (u8)0x11),
+    insn(OpCode::STM, (u8)0x05),
+    // map bank 12:34 into segment 40
+    insn(OpCode::LDDS, (u8)0xf1),
+    insn(OpCode::LDA, (u8)0x12),
+    insn(OpCode::STM, (u8)0x40),
+    insn(OpCode::LDDS, (u8)0xf0),
+    insn(OpCode::LDA, (u8)0x34),
+    insn(OpCode::STM, (u8)0x40),
+    insn(OpCode::LDDS, (u8)0x40),
+    insn(OpCode::LDM, (u8)0x05),
+    insn(OpCode::STA, Register::R1),
+    insn(OpCode::LDA, (u8)0x22),
+    insn(OpCode::STM, (u8)0x05),
+    // bank 00:41 is already in segment 41, so mapping it into segment 42 is refused
+    insn(OpCode::LDDS, (u8)0xf0),
+    insn(OpCode::LDA, (u8)0x41),
+    insn(OpCode::STM, (u8)0x42),
+    insn(OpCode::LDM, (u8)0x42),
+    insn(OpCode::STA, Register::R2),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x00, program);
+
+  CpuState state;
+  PageMask dirty;
+  auto stop = interpret(*mem, state, Callbacks{ .mmioWrite = std::ref(banks) },
+    Options{ .dirtyPages = &dirty, .mmioPages = &banks.pages() });
+  return stop.reason == StopReason::Halted
+    && state.registers.named.r1 == 0x99
+    && state.registers.named.r2 == 0x42
+    && banks.bank(0x40) == 0x1234
+    && banks.bank(0x42) == 0x42
+    && mem->paged[0x40][0x05] == 0x22
+    && banks.contents(0x1234)[0x05] == 0x22
+    && banks.contents(0x40)[0x05] == 0x11
+    && dirty[0x40] && dirty[0xf0] && dirty[0xf1]
+    && !banks.map(0xf1, 0x100)
+    && banks.map(0x40, 0x40) && mem->paged[0x40][0x05] == 0x11;
+}
+
+bool dma_test() {
+  auto mem = std::make_unique<Memory>();
+  Dma dma(0xe000);
+  auto set = [](u8 reg, u8 value) {
+    return std::array{ insn(OpCode::LDA, value), insn(OpCode::STM, reg) };
+  };
+  std::vector<Instruction> body{ insn(OpCode::LDDS, (u8)0xe0) };
+  auto add = [&](std::initializer_list<std::array<Instruction, 2>> regs) {
+    for (auto const& pair : regs) {
+      body.push_back(pair[0]);
+      body.push_back(pair[1]);
+    }
+  };
+  // fill 300 bytes at 40:80, copy them to 50:c0 with an interrupt, and compare the two
+  add({ set(1, 0xab), set(3, 0x40), set(4, 0x80), set(5, 0x2c), set(6, 0x01), set(0, 2) });
+  add({ set(1, 0x40), set(2, 0x80), set(3, 0x50), set(4, 0xc0), set(0, 0x81) });
+  add({ set(0, 3) });
+  body.push_back(insn(OpCode::LDM, (u8)7));
+  body.push_back(insn(OpCode::STA, Register::R1));
+  // then again after changing the sixth byte of the copy
+  body.push_back(insn(OpCode::LDDS, (u8)0x50));
+  add({ set(0xc5, 0x00) });
+  body.push_back(insn(OpCode::LDDS, (u8)0xe0));
+  add({ set(0, 3) });
+  body.push_back(insn(OpCode::LDM, (u8)5));
+  body.push_back(insn(OpCode::STA, Register::R2));
+  body.push_back(insn(OpCode::DSI));
+  body.push_back(insn(OpCode::HLT));
+  load_interrupt_setup(*mem, body);
+
+  CpuState state;
+  PageMask dirty;
+  auto stop = interpret(*mem, state, Callbacks{
+    .pollInterrupt = [&](Memory const&, CpuState const&) { return dma.takeInterrupt(); },
+    .mmioWrite = std::ref(dma),
+  }, Options{ .dirtyPages = &dirty, .mmioPages = &dma.pages() });
+
+  auto copied = std::span{ &mem->direct[0x50c0], 300 };
+  return stop.reason == StopReason::Halted
+    && mem->paged[0xe0][0x10] == 1 // the handler's write, with ds still on the registers
+    && state.registers.named.r1 == static_cast<u8>(Dma::Status::Done)
+    && state.registers.named.r2 == 5
+    && mem->paged[0xe0][Dma::status_reg] == static_cast<u8>(Dma::Status::Mismatch)
+    && mem->paged[0x41][0xab] == 0xab && mem->paged[0x41][0xac] == 0
+    && std::count(copied.begin(), copied.end(), 0xab) == 299
+    && dirty[0x40] && dirty[0x41] && dirty[0x51] && dirty[0xe0];
+}
+
+bool extended_arithmetic_test() {
+  auto mem = std::make_unique<Memory>();
+  std::array program{
+    insn(OpCode::LDA, (u8)200),
+    insn(OpCode::STA, Register::R1),
+    insn(OpCode::MUL), // r1:a = 200 * 200 = 0x9c40
+    insn(OpCode::STA, Register::R4),
+    insn(OpCode::LDA, (u8)0x60),
+    insn(OpCode::STA, Register::R2),
+    insn(OpCode::LDA, (u8)0x63),
+    insn(OpCode::STA, Register::R3),
+    insn(OpCode::LDA, Register::R4),
+    insn(OpCode::ADDW), // 0x9c40 + 0x6360 = 0xffa0
+    insn(OpCode::SUBW), // and back again
+    insn(OpCode::PUSH, Register::R1),
+    insn(OpCode::LDA, (u8)7),
+    insn(OpCode::STA, Register::R1),
+    insn(OpCode::LDA, (u8)100),
+    insn(OpCode::DIV),
+    insn(OpCode::STA, Register::R4),
+    insn(OpCode::LDA, (u8)100),
+    insn(OpCode::MOD),
+    insn(OpCode::STA, Register::R2),
+    insn(OpCode::CLR),
+    insn(OpCode::STA, Register::R1),
+    insn(OpCode::LDA, (u8)5),
+    insn(OpCode::DIV),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x00, program);
+
+  // without the extension, the first of them is invalid
+  CpuState state;
+  auto stop = interpret(*mem, state, Callbacks{});
+  if (stop.reason != StopReason::InvalidInstruction || stop.address != 0x0003 || state.registers.ip != 0x03)
+    return false;
+
+  state = CpuState{};
+  state.registers.ss = 0x80;
+  stop = interpret(*mem, state, Callbacks{}, Options{ .extendedArithmetic = true });
+  return stop.reason == StopReason::Halted
+    && mem->paged[0x80][0x00] == 0x9c
+    && state.registers.named.r4 == 14
+    && state.registers.named.r2 == 2
+    && state.registers.a == 5
+    && state.registers.flags.c;
+}
+
+bool interpreter_variants_test() {
+  if (selectInterpreter(Options{}, Callbacks{}) != &Interpreter<BareConfig>::run) return false;
+  Callbacks polled{ .pollInterrupt = [](Memory const&, CpuState const& state) { return state.retired % 13 == 0; } };
+  if (selectInterpreter(Options{}, polled) != &Interpreter<InterruptConfig>::run) return false;
+  if (selectInterpreter(Options{ .budget = 10 }, Callbacks{}) != &Interpreter<HostedConfig>::run) return false;
+  if (selectInterpreter(Options{ .sharedMemory = true }, Callbacks{}) != &Interpreter<FullConfig>::run) return false;
+
+  // every variant runs random code exactly as the full one does
+  auto same = [](InterpreterFn variant, Memory const& image, CpuState const& start, Callbacks const& callbacks,
+    Options const& options) {
+    auto full = std::make_unique<Memory>(image);
+    auto other = std::make_unique<Memory>(image);
+    CpuState fullState = start;
+    CpuState otherState = start;
+    auto fullStop = Interpreter<FullConfig>::run(*full, fullState, callbacks, options);
+    auto otherStop = variant(*other, otherState, callbacks, options);
+    return fullStop.reason == otherStop.reason
+      && fullStop.address == otherStop.address
+      && std::memcmp(full.get(), other.get(), sizeof(Memory)) == 0
+      && std::memcmp(&fullState.registers, &otherState.registers, sizeof(RegisterPage)) == 0
+      && fullState.cycles == otherState.cycles
+      && fullState.retired == otherState.retired
+      && fullState.intEnabled == otherState.intEnabled;
+  };
+  // random straight-line bodies, so that the ones without a budget stop
+  std::array ops{
+    insn(OpCode::LDA, (u8)0x9d), insn(OpCode::ADD, Register::R1), insn(OpCode::ADC, (u8)0x41),
+    insn(OpCode::SUB, Register::R2), insn(OpCode::SHL), insn(OpCode::ROR), insn(OpCode::XOR, Register::R3),
+    insn(OpCode::INC, Register::R1), insn(OpCode::DEC, Register::R2), insn(OpCode::SWP, Register::R3),
+    insn(OpCode::PUSH, Register::R4), insn(OpCode::POP, Register::R2), insn(OpCode::STM, Register::R1),
+    insn(OpCode::LDM, (u8)0x10), insn(OpCode::MUL), insn(OpCode::DIV), insn(OpCode::ADDW), insn(OpCode::DSI),
+    insn(OpCode::ENI),
+  };
+  std::mt19937 rng(2);
+  for (auto i = 0; i < 300; i++) {
+    std::vector<Instruction> body;
+    for (auto n = 0; n < 60; n++)
+      body.push_back(ops[rng() % ops.size()]);
+    body.push_back(insn(OpCode::HLT));
+    auto image = std::make_unique<Memory>();
+    load_interrupt_setup(*image, body);
+    bool extended = i % 2 == 0;
+    if (!same(&Interpreter<BareConfig>::run, *image, CpuState{}, Callbacks{}, Options{ .extendedArithmetic = extended })
+      || !same(&Interpreter<InterruptConfig>::run, *image, CpuState{}, polled, Options{ .extendedArithmetic = extended })
+      || !same(&Interpreter<HostedConfig>::run, *image, CpuState{}, polled,
+        Options{ .budget = 40, .extendedArithmetic = extended }))
+      return false;
+  }
+  return true;
+}
+
+bool pmu_test() {
+  auto mem = std::make_unique<Memory>();
+  std::vector<Instruction> body{
+    insn(OpCode::LDA, (u8)5),
+    insn(OpCode::STA, Register::R1),
+    insn(OpCode::PUSH, Register::R1), // 00:16
+    insn(OpCode::PUSH, Register::R1),
+    insn(OpCode::POP, Register::R2),
+    insn(OpCode::POP, Register::R2),
+    insn(OpCode::DEC, Register::R1),
+    insn(OpCode::Jc, Condition::NotZero, 0x16),
+    insn(OpCode::DSI),
+  };
+  // interrupts are masked for the 20 nops and the eni, which is longer than the handler takes
+  for (auto i = 0; i < 20; i++)
+    body.push_back(insn(OpCode::NOP));
+  body.push_back(insn(OpCode::ENI));
+  body.push_back(insn(OpCode::LDA, (u8)0x02));
+  body.push_back(insn(OpCode::JF, (u8)0xfe));
+  load_interrupt_setup(*mem, body);
+  // two nops at the end of segment 02, then into segment 03 to latch the counters
+  mem->paged[0x02][0xfe] = mem->paged[0x02][0xff] = mem->paged[0x00][0x2a];
+  std::array latch{
+    insn(OpCode::LDDS, (u8)0xf0),
+    insn(OpCode::LDA, Pmu::latch),
+    insn(OpCode::STM, Pmu::control_reg),
+    insn(OpCode::HLT),
+  };
+  load(*mem, 0x03, latch);
+
+  // the same counts whether or not the loop runs as a trace
+  std::optional<Pmu::Counters> first;
+  for (auto traced : { false, true }) {
+    auto image = std::make_unique<Memory>(*mem);
+    Pmu pmu(0xf0);
+    TraceCache cache(2);
+    CpuState state;
+    auto stop = interpret(*image, state, Callbacks{
+      .pollInterrupt = [](Memory const&, CpuState const& state) { return state.retired == 17; },
+      .mmioWrite = std::ref(pmu),
+    }, Options{ .traces = traced ? &cache : nullptr, .mmioPages = &pmu.pages(), .pmu = &pmu });
+    auto counters = pmu.snapshot();
+    u64 latched = 0;
+    for (auto i = 0; i < 8; i++)
+      latched |= static_cast<u64>(image->paged[0xf0][Pmu::counters_offset + i]) << (8 * i);
+    if (stop.reason != StopReason::Halted
+      || counters.retired != state.retired
+      || counters.cycles != state.cycles
+      || counters.interrupts != 1
+      || counters.maxInterruptLatency != 21
+      || counters.farJumps != 1
+      || counters.segmentCrossings != 1
+      || counters.stackHighWater != 0x8002
+      || counters.invalidInstructions != 0
+      || latched != state.retired - 1
+      || image->paged[0xf0][Pmu::control_reg] != 0
+      || (traced && cache.size() == 0))
+      return false;
+    if (first && std::memcmp(&*first, &counters, sizeof(counters)) != 0)
+      return false;
+    first = counters;
+  }
+
+  // an instruction which isn't enabled is counted as invalid
+  std::array invalid{ insn(OpCode::NOP), insn(OpCode::MUL) };
+  load(*mem, 0x00, invalid);
+  Pmu pmu(0xf0);
+  CpuState state;
+  interpret(*mem, state, Callbacks{}, Options{ .pmu = &pmu });
+  if (pmu.snapshot().invalidInstructions != 1 || pmu.snapshot().retired != 1)
+    return false;
+  pmu.reset();
+  return pmu.snapshot().retired == 0;
+}
+
+bool gdb_test() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return false;
+  auto mem = std::make_unique<Memory>();
+  CpuState state;
+  Callbacks callbacks;
+  GdbStub stub(*mem, state, callbacks);
+  std::thread server([&] { stub.serveConnection(fds[0]); });
+
+  // sends a packet and acks the reply, returning its data
+  auto exchange = [&](std::string const& data) {
+    constexpr char digits[] = "0123456789abcdef";
+    u8 sum = 0;
+    for (auto c : data)
+      sum += static_cast<u8>(c);
+    auto packet = "$" + data + "#" + digits[sum >> 4] + digits[sum & 0xf];
+    send(fds[1], packet.data(), packet.size(), MSG_NOSIGNAL);
+    std::string reply;
+    char c;
+    while (recv(fds[1], &c, 1, 0) == 1 && c != '$') {} // the stub's ack
+    while (recv(fds[1], &c, 1, 0) == 1 && c != '#')
+      reply += c;
+    char checksum[2];
+    recv(fds[1], checksum, sizeof(checksum), MSG_WAITALL);
+    send(fds[1], "+", 1, MSG_NOSIGNAL);
+    return reply;
+  };
+
+  // a watchpoint's length comes from the debugger, so one which is empty or longer than memory is refused
+  bool ok = exchange("Z2,1000,ffffffff") == "E01"
+    && exchange("Z4,1000,0") == "E01"
+    && exchange("Z2,1000,10000") == "OK"
+    && exchange("z2,1000,10000") == "OK"
+    && exchange("Z3,2010,2") == "OK";
+  bool detached = exchange("D") == "OK";
+  server.join();
+  close(fds[0]);
+  close(fds[1]);
+  return ok && detached;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    std::cout << argv[0] << " takes one argument.\n";
+    return 1;
+  }
+  if (std::string(argv[1]) == "cycles")
+    return !cycles_test();
+  if (std::string(argv[1]) == "idle_skip")
+    return !idle_skip_test();
+  if (std::string(argv[1]) == "halt_wait")
+    return !halt_wait_test();
+  if (std::string(argv[1]) == "multicore_ipi")
+    return !multicore_ipi_test();
+  if (std::string(argv[1]) == "breakpoints")
+    return !breakpoints_test();
+  if (std::string(argv[1]) == "stack_wrap")
+    return !stack_wrap_test();
+  if (std::string(argv[1]) == "hostcall")
+    return !hostcall_test();
+  if (std::string(argv[1]) == "checkpoint")
+    return !checkpoint_test();
+  if (std::string(argv[1]) == "page_pool")
+    return !page_pool_test();
+  if (std::string(argv[1]) == "scheduler")
+    return !scheduler_test();
+  if (std::string(argv[1]) == "history")
+    return !history_test();
+  if (std::string(argv[1]) == "traces")
+    return !traces_test();
+  if (std::string(argv[1]) == "banks")
+    return !banks_test();
+  if (std::string(argv[1]) == "dma")
+    return !dma_test();
+  if (std::string(argv[1]) == "extended_arithmetic")
+    return !extended_arithmetic_test();
+  if (std::string(argv[1]) == "interpreter_variants")
+    return !interpreter_variants_test();
+  if (std::string(argv[1]) == "pmu")
+    return !pmu_test();
+  if (std::string(argv[1]) == "gdb")
+    return !gdb_test();
+
+  std::cout << "Unrecognized test." << std::endl;
+  return 0;
+}
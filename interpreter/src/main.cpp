@@ -1,8 +1,15 @@
 
 #include "types.hpp"
 #include "interp.hpp"
+#include "gdb.hpp"
+#include "hostio.hpp"
 
+#include <algorithm>
+#include <charconv>
+#include <functional>
+#include <iostream>
 #include <memory>
+#include <string_view>
 #include <utility>
 
 int main(int argc, char const* const* argv) {
@@ -43,9 +50,36 @@ int main(int argc, char const* const* argv) {
     0b11001011
   };
 
-  daisa::interpreter::interpret(*mem, 0, [](auto const& mem, auto const& regs) {
+  auto pollInterrupt = [](auto const& mem, auto const& regs) {
     return true; // always interrupt
-  });
+  };
+
+  using namespace daisa::interpreter;
+  HostIO io;
+  CpuState state;
+  Callbacks callbacks{ .pollInterrupt = pollInterrupt, .hostCall = std::ref(io) };
+
+  // --gdb <port or socket path> waits for a debugger before running
+  if (argc == 3 && std::string_view(argv[1]) == "--gdb") {
+    std::string_view target = argv[2];
+    GdbStub stub(*mem, state, callbacks);
+
+    bool served;
+    if (std::all_of(target.begin(), target.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+      daisa::u16 port = 0;
+      std::from_chars(target.data(), target.data() + target.size(), port);
+      served = stub.serveTcp(port);
+    } else {
+      served = stub.serveUnix(std::string(target));
+    }
+    if (!served) {
+      std::cerr << "Could not listen for a debugger on " << target << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  interpret(*mem, state, callbacks);
 
   return 0;
 }
@@ -0,0 +1,190 @@
+#include "pagepool.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+namespace {
+
+  constexpr std::size_t huge_page_size = 2 << 20;
+
+  u8* mapAnonymous(void* at, std::size_t size, int flags) {
+    auto* addr = ::mmap(at, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | flags, -1, 0);
+    return addr == MAP_FAILED ? nullptr : static_cast<u8*>(addr);
+  }
+
+}
+
+PagePool::Instance::Instance(Instance&& other) noexcept
+  : pool(std::exchange(other.pool, nullptr)), slot(other.slot) {}
+
+PagePool::Instance& PagePool::Instance::operator=(Instance&& other) noexcept {
+  if (this != &other) {
+    if (pool)
+      pool->release(slot);
+    pool = std::exchange(other.pool, nullptr);
+    slot = other.slot;
+  }
+  return *this;
+}
+
+PagePool::Instance::~Instance() {
+  if (pool)
+    pool->release(slot);
+}
+
+Memory& PagePool::Instance::memory() const noexcept {
+  return *reinterpret_cast<Memory*>(pool->slotAddress(slot));
+}
+
+PagePool::PagePool(std::size_t maxInstances, bool hugePages)
+  : groupSize(static_cast<std::size_t>(::sysconf(_SC_PAGESIZE))), maxInstances(maxInstances), hugePages(hugePages) {
+  if (groupSize % 256 != 0 || sizeof(Memory) % groupSize != 0)
+    throw std::system_error(std::make_error_code(std::errc::not_supported), "host page size cannot be split into guest pages");
+
+  // the file is sparse, so it only takes memory for the groups actually in it
+  fileSize = maxInstances * sizeof(Memory);
+  file = ::memfd_create("daisa-shared-pages", MFD_CLOEXEC);
+  if (file < 0)
+    throw std::system_error(errno, std::generic_category(), "could not create the shared page file");
+  auto* mapped = ::ftruncate(file, static_cast<off_t>(fileSize)) == 0
+    ? ::mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0)
+    : MAP_FAILED;
+  if (mapped == MAP_FAILED) {
+    auto error = errno;
+    ::close(file);
+    throw std::system_error(error, std::generic_category(), "could not map the shared page file");
+  }
+  view = static_cast<u8*>(mapped);
+
+  // over-reserve so that the arena can start on a huge page boundary
+  arenaSize = maxInstances * sizeof(Memory) + (hugePages ? huge_page_size : 0);
+  arena = mapAnonymous(nullptr, arenaSize, 0);
+  if (!arena) {
+    auto error = errno;
+    ::munmap(view, fileSize);
+    ::close(file);
+    throw std::system_error(error, std::generic_category(), "could not reserve the page pool arena");
+  }
+  if (hugePages) {
+    arenaOffset = (huge_page_size - reinterpret_cast<std::uintptr_t>(arena) % huge_page_size) % huge_page_size;
+    ::madvise(arena + arenaOffset, maxInstances * sizeof(Memory), MADV_HUGEPAGE); // only a hint, so failure is fine
+  }
+  arena += arenaOffset;
+
+  auto perSlot = sizeof(Memory) / groupSize;
+  slotGroups.assign(maxInstances * perSlot, npos);
+  freeSlots.reserve(maxInstances);
+  for (auto slot = maxInstances; slot > 0; slot--)
+    freeSlots.push_back(slot - 1);
+}
+
+PagePool::~PagePool() {
+  ::munmap(arena - arenaOffset, arenaSize);
+  ::munmap(view, fileSize);
+  ::close(file);
+}
+
+std::size_t PagePool::sharedGroups() const {
+  std::lock_guard guard(lock);
+  return groups.size() - freeGroups.size();
+}
+
+std::size_t PagePool::internGroup(u8 const* data) {
+  auto hash = std::hash<std::string_view>{}(std::string_view(reinterpret_cast<char const*>(data), groupSize));
+  auto [first, last] = groupsByHash.equal_range(hash);
+  for (auto it = first; it != last; ++it) {
+    if (std::memcmp(view + it->second * groupSize, data, groupSize) == 0) {
+      groups[it->second].refs++;
+      return it->second;
+    }
+  }
+
+  std::size_t group;
+  if (!freeGroups.empty()) {
+    group = freeGroups.back();
+    freeGroups.pop_back();
+  } else {
+    group = groups.size();
+    groups.emplace_back();
+  }
+  std::memcpy(view + group * groupSize, data, groupSize);
+  groups[group] = Group{ hash, 1 };
+  groupsByHash.emplace(hash, group);
+  return group;
+}
+
+void PagePool::releaseGroup(std::size_t group) {
+  if (--groups[group].refs != 0)
+    return;
+  auto [first, last] = groupsByHash.equal_range(groups[group].hash);
+  for (auto it = first; it != last; ++it) {
+    if (it->second == group) {
+      groupsByHash.erase(it);
+      break;
+    }
+  }
+  ::fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(group * groupSize), static_cast<off_t>(groupSize));
+  freeGroups.push_back(group);
+}
+
+PagePool::Instance PagePool::create(Memory const& image, PageMask const& shared) {
+  std::lock_guard guard(lock);
+  if (freeSlots.empty())
+    return {};
+  auto slot = freeSlots.back();
+  freeSlots.pop_back();
+
+  auto* base = slotAddress(slot);
+  auto perSlot = sizeof(Memory) / groupSize;
+  auto pagesPerGroup = groupSize / 256;
+  for (auto index = 0u; index < perSlot; index++) {
+    auto* target = base + index * groupSize;
+    auto const* source = image.direct.data() + index * groupSize;
+
+    bool share = true;
+    for (auto page = index * pagesPerGroup; page < (index + 1) * pagesPerGroup; page++)
+      share = share && shared[page];
+    if (share) {
+      auto group = internGroup(source);
+      auto* mapped = ::mmap(target, groupSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+        file, static_cast<off_t>(group * groupSize));
+      if (mapped != MAP_FAILED) {
+        slotGroups[slot * perSlot + index] = group;
+        continue;
+      }
+      releaseGroup(group); // fall back to a private copy
+    }
+    std::memcpy(target, source, groupSize);
+  }
+
+  return Instance(this, slot);
+}
+
+void PagePool::release(std::size_t slot) {
+  std::lock_guard guard(lock);
+  auto* base = slotAddress(slot);
+  // replacing the whole slot with fresh anonymous memory drops both private copies and shared mappings
+  if (!mapAnonymous(base, sizeof(Memory), MAP_FIXED))
+    std::memset(base, 0, sizeof(Memory)); // only fails for lack of memory; writing every page detaches it all the same
+  else if (hugePages)
+    ::madvise(base, sizeof(Memory), MADV_HUGEPAGE);
+
+  auto perSlot = sizeof(Memory) / groupSize;
+  for (auto index = 0u; index < perSlot; index++) {
+    auto& group = slotGroups[slot * perSlot + index];
+    if (group != npos)
+      releaseGroup(std::exchange(group, npos));
+  }
+  freeSlots.push_back(slot);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Allocates the Memory of many guests from one arena, sharing identical read-only pages between them.
+  /// @note Sharing is done by mapping the same host page copy-on-write into each guest, so pages are shared in
+  ///   groups of host page size / 256 (16, with 4 KiB host pages), and a write to any of them copies the group.
+  class PagePool {
+  public:
+    /// @brief A guest's memory, which is returned to the pool when destroyed. Must not outlive the pool.
+    class Instance {
+      PagePool* pool = nullptr;
+      std::size_t slot = 0;
+
+      friend class PagePool;
+      Instance(PagePool* pool, std::size_t slot) noexcept : pool(pool), slot(slot) {}
+
+    public:
+      Instance() noexcept = default;
+      Instance(Instance&& other) noexcept;
+      Instance& operator=(Instance&& other) noexcept;
+      ~Instance();
+
+      [[nodiscard]] explicit operator bool() const noexcept { return pool != nullptr; }
+      [[nodiscard]] Memory& memory() const noexcept;
+    };
+
+    /// @param[in]  maxInstances  The number of guests the arena has room for.
+    /// @param[in]  hugePages     Whether to ask for transparent huge pages to back the arena.
+    /// @throws std::system_error if the arena cannot be reserved.
+    explicit PagePool(std::size_t maxInstances, bool hugePages = false);
+    ~PagePool();
+
+    PagePool(PagePool const&) = delete;
+    PagePool& operator=(PagePool const&) = delete;
+
+    /// @brief Creates a guest whose memory starts as a copy of image.
+    /// @param[in]  image   The initial contents of memory.
+    /// @param[in]  shared  Pages which may be shared with other guests with the same contents; a group of pages
+    ///   is only shared if every page in it is marked.
+    /// @return The new guest, or an empty Instance if the arena is full.
+    [[nodiscard]] Instance create(Memory const& image, PageMask const& shared);
+
+    /// @brief The number of distinct groups of pages currently shared.
+    [[nodiscard]] std::size_t sharedGroups() const;
+    /// @brief The number of guest pages in each shared group.
+    [[nodiscard]] std::size_t groupPages() const noexcept { return groupSize / 256; }
+
+  private:
+    struct Group {
+      u64 hash;
+      std::size_t refs;
+    };
+
+    std::size_t groupSize;
+    std::size_t maxInstances;
+    bool hugePages;
+    u8* arena = nullptr;
+    std::size_t arenaSize = 0;
+    std::size_t arenaOffset = 0;
+
+    // shared groups live in a memory file, which each guest maps privately; view is a shared mapping of all of it
+    int file = -1;
+    u8* view = nullptr;
+    std::size_t fileSize = 0;
+
+    mutable std::mutex lock;
+    std::vector<std::size_t> freeSlots;
+    std::vector<Group> groups;
+    std::vector<std::size_t> freeGroups;
+    std::unordered_multimap<u64, std::size_t> groupsByHash;
+    /// the shared group mapped at each group of each slot, or npos
+    std::vector<std::size_t> slotGroups;
+
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    [[nodiscard]] u8* slotAddress(std::size_t slot) const noexcept { return arena + slot * sizeof(Memory); }
+    [[nodiscard]] std::size_t internGroup(u8 const* data);
+    void releaseGroup(std::size_t group);
+    void release(std::size_t slot);
+  };
+
+}
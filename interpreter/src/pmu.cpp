@@ -0,0 +1,40 @@
+#include "pmu.hpp"
+
+#include <array>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+Pmu::Pmu(u8 page) : page(page) {
+  mmio[page] = true;
+}
+
+void Pmu::reset() noexcept {
+  counters = {};
+  maskedSince.reset();
+}
+
+void Pmu::operator()(Memory& mem, u16 addr, u8 value, PageMask& changed) {
+  if (addr != ((page << 8) | control_reg) || (value != latch && value != clear))
+    return;
+  if (value == clear)
+    reset();
+
+  std::array values{
+    counters.retired,
+    counters.cycles,
+    counters.interrupts,
+    counters.maxInterruptLatency,
+    counters.farJumps,
+    counters.segmentCrossings,
+    counters.stackHighWater,
+    counters.invalidInstructions,
+  };
+  auto* out = &mem.paged[page][counters_offset];
+  for (auto v : values) {
+    for (auto i = 0; i < 8; i++)
+      *out++ = static_cast<u8>(v >> (8 * i));
+  }
+  mem.paged[page][control_reg] = 0;
+  changed[page] = true;
+}
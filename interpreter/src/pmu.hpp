@@ -0,0 +1,88 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <algorithm>
+#include <optional>
+
+namespace daisa::interpreter {
+
+  /// @brief Performance counters for one cpu, which interpret keeps up to date when it is set in Options::pmu.
+  /// @note The host reads them with snapshot. The guest sees them in a page of its own: writing latch to the
+  ///   control register copies the counters into the page, as little-endian 64-bit values in the order of Counters
+  ///   from counters_offset, and writing clear zeroes them first. The page is only written when latched, so the
+  ///   guest reads a consistent set. Retired instructions and cycles are added once per block, at each taken jump,
+  ///   interrupt, device store and stop, rather than after each instruction. Not thread-safe.
+  class Pmu {
+  public:
+    struct Counters {
+      u64 retired = 0;
+      u64 cycles = 0;
+      u64 interrupts = 0;
+      /// the longest time in cycles that interrupts were masked by dsi or an interrupt handler, which is the
+      ///   longest an interrupt could have had to wait
+      u64 maxInterruptLatency = 0;
+      /// jf and callf
+      u64 farJumps = 0;
+      /// ip running off the end of a segment into the next
+      u64 segmentCrossings = 0;
+      /// the highest ss:sp has been after a push
+      u64 stackHighWater = 0;
+      /// stops at an instruction which could not be decoded, or was not enabled
+      u64 invalidInstructions = 0;
+    };
+
+    /// values for the control register
+    static constexpr u8 latch = 1;
+    static constexpr u8 clear = 2;
+    /// offsets in the page
+    static constexpr u8 control_reg = 0;
+    static constexpr u8 counters_offset = 8;
+
+    /// @param[in]  page  The page the guest sees the counters in.
+    explicit Pmu(u8 page);
+
+    /// @brief The counters as they are now.
+    [[nodiscard]] Counters snapshot() const noexcept { return counters; }
+    /// @brief Zeroes the counters, without touching the guest's page.
+    void reset() noexcept;
+
+    /// @brief The pages for Options::mmioPages.
+    [[nodiscard]] PageMask const& pages() const noexcept { return mmio; }
+    /// @brief Handles a store to the page, for Callbacks::mmioWrite; only writing the control register does anything.
+    void operator()(Memory& mem, u16 addr, u8 value, PageMask& changed);
+
+    // the rest is used by interpret
+
+    /// adds the instructions and cycles the cpu has run since the last sync
+    void sync(CpuState const& state) noexcept {
+      // a cpu whose counts went backwards has been replaced, so everything it has counted is new
+      counters.retired += state.retired >= retiredMark ? state.retired - retiredMark : state.retired;
+      counters.cycles += state.cycles >= cyclesMark ? state.cycles - cyclesMark : state.cycles;
+      retiredMark = state.retired;
+      cyclesMark = state.cycles;
+    }
+    void interruptTaken() noexcept { counters.interrupts++; }
+    void farJump() noexcept { counters.farJumps++; }
+    void crossedSegment() noexcept { counters.segmentCrossings++; }
+    void pushed(u16 top) noexcept { counters.stackHighWater = std::max<u64>(counters.stackHighWater, top); }
+    void invalidInstruction() noexcept { counters.invalidInstructions++; }
+    /// interrupts were masked at a cycle count
+    void masked(u64 cycles) noexcept { maskedSince = cycles; }
+    /// interrupts were unmasked at a cycle count
+    void unmasked(u64 cycles) noexcept {
+      if (maskedSince && cycles >= *maskedSince)
+        counters.maxInterruptLatency = std::max(counters.maxInterruptLatency, cycles - *maskedSince);
+      maskedSince.reset();
+    }
+
+  private:
+    u8 page;
+    PageMask mmio;
+    Counters counters;
+    u64 retiredMark = 0;
+    u64 cyclesMark = 0;
+    std::optional<u64> maskedSince;
+  };
+
+}
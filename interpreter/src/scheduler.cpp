@@ -0,0 +1,180 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <utility>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+class Scheduler::Task {
+public:
+  struct promise_type {
+    Guest& guest;
+
+    explicit promise_type(Guest& guest) noexcept : guest(guest) {}
+
+    Task get_return_object() noexcept { return Task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { guest.error = std::current_exception(); }
+  };
+
+  std::coroutine_handle<> handle;
+};
+
+/// suspends a guest's coroutine until it can resume; with Wait::None, just lets the others run first
+struct Scheduler::Block {
+  Guest& guest;
+  Guest::Wait reason;
+  u8 channel = 0;
+
+  bool await_ready() const { return reason != Guest::Wait::None && guest.canResume(reason, channel); }
+  void await_suspend(std::coroutine_handle<>) noexcept {
+    guest.waiting = reason;
+    guest.waitChannel = channel;
+  }
+  void await_resume() const noexcept {}
+};
+
+Scheduler::Guest::Guest(Memory& mem, CpuState const& state, Callbacks const& callbacks, Options const& options)
+  : mem(mem), cpu(state), callbacks(callbacks), options(options) {
+  hooks = Callbacks{
+    .pollInterrupt = [this](Memory const& mem, CpuState const& state) {
+      return std::exchange(pending, false)
+        || (this->callbacks.pollInterrupt && this->callbacks.pollInterrupt(mem, state));
+    },
+    .nextInterrupt = [this](CpuState const& state) -> std::optional<u64> {
+      if (pending)
+        return state.cycles;
+      if (this->callbacks.nextInterrupt)
+        return this->callbacks.nextInterrupt(state);
+      if (this->callbacks.pollInterrupt)
+        return state.cycles; // keep polling until the time slice runs out
+      return std::nullopt;
+    },
+    .hostCall = [this](HostCall const& call, std::span<u8> buffer) -> std::optional<u16> {
+      if (call.service == HostService::Read)
+        return read(call.channel, buffer);
+      if (this->callbacks.hostCall)
+        return this->callbacks.hostCall(call, buffer);
+      return std::nullopt;
+    },
+  };
+}
+
+Scheduler::Guest::~Guest() {
+  if (handle)
+    handle.destroy();
+}
+
+bool Scheduler::Guest::canResume(Wait reason, u8 channel) const {
+  switch (reason) {
+    case Wait::None:
+      return true;
+    case Wait::Interrupt:
+      return pending;
+    case Wait::Input:
+      if (auto it = inputs.find(channel); it != inputs.end())
+        return !it->second.bytes.empty() || it->second.closed;
+      return false;
+  }
+  return true;
+}
+
+std::optional<u8> Scheduler::Guest::blockingRead() const {
+  auto const& list = mem.paged[cpu.registers.ds];
+  for (auto at = static_cast<unsigned>(cpu.registers.a); at + host_call_size <= 256; at += host_call_size) {
+    auto service = static_cast<HostService>(list[at]);
+    if (service == HostService::End)
+      break;
+    if (service == HostService::Read && !canResume(Wait::Input, list[at + 1]))
+      return list[at + 1];
+  }
+  return std::nullopt;
+}
+
+std::optional<u16> Scheduler::Guest::read(u8 channel, std::span<u8> buffer) {
+  auto it = inputs.find(channel);
+  if (it == inputs.end())
+    return std::nullopt;
+  auto& bytes = it->second.bytes;
+  auto count = std::min(buffer.size(), bytes.size());
+  std::copy_n(bytes.begin(), count, buffer.begin());
+  bytes.erase(bytes.begin(), bytes.begin() + static_cast<std::ptrdiff_t>(count));
+  return static_cast<u16>(count);
+}
+
+Scheduler::Task Scheduler::drive(Guest& guest) {
+  auto& registers = guest.cpu.registers;
+  while (true) {
+    auto stop = interpret(guest.mem, guest.cpu, guest.hooks, guest.options);
+    switch (stop.reason) {
+      case StopReason::BudgetExhausted:
+        co_await Block{ guest, Guest::Wait::None };
+        break;
+      case StopReason::HostCall:
+        while (auto channel = guest.blockingRead())
+          co_await Block{ guest, Guest::Wait::Input, *channel };
+        registers.a = serviceHostCalls(guest.mem, registers.ds, registers.a, guest.hooks, guest.options);
+        break;
+      case StopReason::Halted:
+        if (guest.cpu.intEnabled) {
+          co_await Block{ guest, Guest::Wait::Interrupt };
+          break;
+        }
+        [[fallthrough]];
+      default:
+        guest.result = stop;
+        co_return;
+    }
+  }
+}
+
+Scheduler::Guest& Scheduler::spawn(Memory& mem, CpuState const& state, Callbacks const& callbacks, Options options) {
+  options.haltMode = HaltMode::WaitForInterrupt;
+  options.budget = slice;
+  options.deferHostCalls = true;
+
+  auto& guest = *guests.emplace_back(new Guest(mem, state, callbacks, options));
+  guest.handle = drive(guest).handle;
+  ready.push_back(&guest);
+  return guest;
+}
+
+void Scheduler::wake(Guest& guest) {
+  if (guest.waiting != Guest::Wait::None && guest.canResume(guest.waiting, guest.waitChannel)) {
+    guest.waiting = Guest::Wait::None;
+    ready.push_back(&guest);
+  }
+}
+
+void Scheduler::interrupt(Guest& guest) {
+  guest.pending = true;
+  wake(guest);
+}
+
+void Scheduler::send(Guest& guest, u8 channel, std::span<u8 const> bytes) {
+  auto& input = guest.inputs[channel];
+  input.bytes.insert(input.bytes.end(), bytes.begin(), bytes.end());
+  wake(guest);
+}
+
+void Scheduler::closeInput(Guest& guest, u8 channel) {
+  guest.inputs[channel].closed = true;
+  wake(guest);
+}
+
+std::size_t Scheduler::run() {
+  while (!ready.empty()) {
+    auto& guest = *ready.front();
+    ready.pop_front();
+    guest.handle.resume();
+    if (guest.error)
+      std::rethrow_exception(std::exchange(guest.error, nullptr));
+    if (!guest.handle.done() && guest.waiting == Guest::Wait::None)
+      ready.push_back(&guest);
+  }
+  return static_cast<std::size_t>(std::count_if(guests.begin(), guests.end(),
+    [](auto const& guest) { return !guest->finished(); }));
+}
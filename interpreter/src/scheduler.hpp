@@ -0,0 +1,109 @@
+#pragma once
+
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Runs many guests on one thread, each as a coroutine which gives way to the others when it uses up
+  ///   its time slice, halts to wait for an interrupt, or reads input which hasn't arrived yet.
+  /// @note Nothing here is thread-safe; interrupts and input must be given from the thread calling run.
+  class Scheduler {
+    class Task;
+    struct Block;
+
+  public:
+    class Guest {
+    public:
+      Guest(Guest const&) = delete;
+      Guest& operator=(Guest const&) = delete;
+      ~Guest();
+
+      [[nodiscard]] CpuState& state() noexcept { return cpu; }
+      [[nodiscard]] CpuState const& state() const noexcept { return cpu; }
+      [[nodiscard]] bool finished() const noexcept { return result.has_value(); }
+      /// why the guest stopped, once it has finished: it halted with interrupts disabled, or hit an invalid
+      ///   instruction, breakpoint or watchpoint
+      [[nodiscard]] std::optional<Stop> stop() const noexcept { return result; }
+
+    private:
+      friend class Scheduler;
+
+      enum class Wait {
+        /// runnable
+        None,
+        Interrupt,
+        Input,
+      };
+
+      struct Input {
+        std::deque<u8> bytes;
+        bool closed = false;
+      };
+
+      Memory& mem;
+      CpuState cpu;
+      Callbacks callbacks;
+      Callbacks hooks;
+      Options options;
+
+      bool pending = false;
+      Wait waiting = Wait::None;
+      u8 waitChannel = 0;
+      std::unordered_map<u8, Input> inputs;
+      std::optional<Stop> result;
+      std::exception_ptr error;
+      std::coroutine_handle<> handle;
+
+      Guest(Memory& mem, CpuState const& state, Callbacks const& callbacks, Options const& options);
+
+      [[nodiscard]] bool canResume(Wait reason, u8 channel) const;
+      /// the first channel read from by the pending hcall which has nothing to read yet
+      [[nodiscard]] std::optional<u8> blockingRead() const;
+      [[nodiscard]] std::optional<u16> read(u8 channel, std::span<u8> buffer);
+    };
+
+    /// @param[in]  slice  The number of instructions each guest runs before giving way to the next.
+    explicit Scheduler(u64 slice = 1 << 16) noexcept : slice(slice) {}
+
+    Scheduler(Scheduler const&) = delete;
+    Scheduler& operator=(Scheduler const&) = delete;
+
+    /// @brief Adds a guest, which starts running on the next call to run.
+    /// @param[in]  callbacks  Used for interrupts raised by the host and for host calls other than reads, which
+    ///   are served from input given through send instead; only consulted while the guest is running.
+    /// @param[in]  options    Options for the guest; halting always waits for an interrupt, and host calls are always deferred.
+    Guest& spawn(Memory& mem, CpuState const& state, Callbacks const& callbacks = {}, Options options = {});
+
+    /// @brief Raises an interrupt on a guest, waking it if it is halted.
+    void interrupt(Guest& guest);
+    /// @brief Queues input for a guest to read from a channel, waking it if it is waiting for it.
+    void send(Guest& guest, u8 channel, std::span<u8 const> bytes);
+    /// @brief Marks the end of a channel's input, after which reads of it complete with nothing.
+    void closeInput(Guest& guest, u8 channel);
+
+    /// @brief Runs guests until every one has either finished or is waiting for an interrupt or input.
+    /// @return The number of guests which have not finished.
+    /// @throws Whatever was thrown by a callback, after which that guest cannot be resumed.
+    std::size_t run();
+
+  private:
+    u64 slice;
+    std::vector<std::unique_ptr<Guest>> guests;
+    std::deque<Guest*> ready;
+
+    void wake(Guest& guest);
+    static Task drive(Guest& guest);
+  };
+
+}
@@ -0,0 +1,113 @@
+#include "system.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+System::System(Memory& mem, std::size_t coreCount) : mem(mem) {
+  if (coreCount == 0 || coreCount > max_cores)
+    throw std::invalid_argument("System must have between 1 and max_cores cores");
+  cores.reserve(coreCount);
+  for (auto i = 0u; i < coreCount; i++) {
+    auto core = std::make_unique<Core>();
+    core->state.registers.named.r1 = static_cast<u8>(i);
+    cores.push_back(std::move(core));
+  }
+}
+
+u8& System::mailbox(std::size_t core) noexcept {
+  return mem.direct[ipi_mailbox + core];
+}
+
+bool System::hasInterrupt(std::size_t core) noexcept {
+  return cores[core]->pending.load(std::memory_order_acquire)
+    || std::atomic_ref(mailbox(core)).load(std::memory_order_acquire) != 0;
+}
+
+bool System::takeInterrupt(std::size_t core) noexcept {
+  // this runs after every instruction, so only do a locked exchange when something is actually there
+  auto& pending = cores[core]->pending;
+  if (pending.load(std::memory_order_relaxed) && pending.exchange(false, std::memory_order_acq_rel))
+    return true;
+  auto box = std::atomic_ref(mailbox(core));
+  return box.load(std::memory_order_relaxed) != 0 && box.exchange(0, std::memory_order_acq_rel) != 0;
+}
+
+bool System::anyInterrupt() noexcept {
+  for (auto i = 0u; i < cores.size(); i++) {
+    if (hasInterrupt(i))
+      return true;
+  }
+  return false;
+}
+
+void System::notify(std::size_t core) {
+  auto& c = *cores[core];
+  { std::lock_guard guard(c.lock); } // a waiter either sees the change before waiting, or gets woken
+  c.wake.notify_all();
+}
+
+void System::interrupt(std::size_t core) {
+  cores[core]->pending.store(true, std::memory_order_release);
+  notify(core);
+}
+
+void System::runCore(std::size_t index, Callbacks const& callbacks, Options options) {
+  auto& core = *cores[index];
+  Callbacks coreCallbacks{
+    .pollInterrupt = [&](Memory const& mem, CpuState const& state) {
+      return takeInterrupt(index)
+        || (callbacks.pollInterrupt && callbacks.pollInterrupt(mem, state));
+    },
+    .nextInterrupt = [&](CpuState const& state) -> std::optional<u64> {
+      using namespace std::chrono_literals;
+      std::unique_lock guard(core.lock);
+      while (true) {
+        if (hasInterrupt(index))
+          return state.cycles;
+        if (callbacks.nextInterrupt) {
+          if (auto next = callbacks.nextInterrupt(state))
+            return next;
+        } else if (callbacks.pollInterrupt) {
+          return state.cycles; // the host may raise one at any time, so keep polling
+        }
+        // once every core left is waiting like this, with nothing pending, none of them can wake another
+        waiting++;
+        bool stuck = waiting.load() >= running.load() && !anyInterrupt();
+        if (!stuck) {
+          // guest IPIs are plain stores to the mailbox, which nothing signals, so wait in short slices
+          core.wake.wait_for(guard, 1ms);
+        }
+        waiting--;
+        if (stuck)
+          return std::nullopt;
+      }
+    },
+  };
+
+  interpret(mem, core.state, coreCallbacks, options);
+
+  running--;
+  for (auto i = 0u; i < cores.size(); i++)
+    notify(i);
+}
+
+void System::run(Callbacks const& callbacks, Options options) {
+  // these are written by every core, without synchronisation
+  if (options.dirtyPages || options.coverage || options.traces || options.pmu)
+    throw std::invalid_argument("System can't share dirtyPages, coverage, traces or pmu between cores");
+  options.sharedMemory = true;
+  options.skipIdleLoops = false; // other cores may write memory at any time
+
+  running = cores.size();
+  waiting = 0;
+  std::vector<std::thread> threads;
+  threads.reserve(cores.size());
+  for (auto i = 0u; i < cores.size(); i++)
+    threads.emplace_back([&, i] { runCore(i, callbacks, options); });
+  for (auto& thread : threads)
+    thread.join();
+}
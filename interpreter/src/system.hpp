@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Several cores sharing one Memory, each interpreted on its own host thread.
+  /// @note Each core starts with its index in r1. Cycle counters are per core, and are not synchronised.
+  class System {
+  public:
+    /// core n has a one-byte mailbox at ipi_mailbox + n; writing a nonzero value to it interrupts that core
+    static constexpr u16 ipi_mailbox = 0xfff0;
+    static constexpr std::size_t max_cores = 8;
+
+  private:
+    struct Core {
+      CpuState state;
+      std::atomic<bool> pending = false;
+      std::mutex lock;
+      std::condition_variable wake;
+    };
+
+    Memory& mem;
+    std::vector<std::unique_ptr<Core>> cores;
+    std::atomic<std::size_t> running = 0;
+    // cores halted with nothing to wake them but another core
+    std::atomic<std::size_t> waiting = 0;
+
+    [[nodiscard]] u8& mailbox(std::size_t core) noexcept;
+    [[nodiscard]] bool takeInterrupt(std::size_t core) noexcept;
+    [[nodiscard]] bool hasInterrupt(std::size_t core) noexcept;
+    [[nodiscard]] bool anyInterrupt() noexcept;
+    void notify(std::size_t core);
+    void runCore(std::size_t core, Callbacks const& callbacks, Options options);
+
+  public:
+    System(Memory& mem, std::size_t coreCount);
+
+    [[nodiscard]] std::size_t size() const noexcept { return cores.size(); }
+    [[nodiscard]] CpuState& state(std::size_t core) noexcept { return cores[core]->state; }
+    [[nodiscard]] CpuState const& state(std::size_t core) const noexcept { return cores[core]->state; }
+
+    /// @brief Raises an inter-processor interrupt on a core. May be called from any thread.
+    void interrupt(std::size_t core);
+
+    /// @brief Runs every core on its own thread until all of them have stopped.
+    /// @note A core halted waiting for an interrupt stops once every other core still running is too, and none has
+    ///   one pending, so an interrupt from the host only wakes cores while at least one is running.
+    /// @param[in]  callbacks  Used by each core for host-raised interrupts, in addition to IPIs; called from every core's thread.
+    ///   So is mmioWrite, at once, so it and the devices behind it, such as Banks and Dma, must be thread-safe.
+    /// @param[in]  options    Options for each core; shared memory is always enabled, and idle loops are never skipped.
+    ///   The budget applies to each core separately. dirtyPages, coverage, traces and pmu can't be shared between
+    ///   cores, so setting any of them throws std::invalid_argument.
+    void run(Callbacks const& callbacks, Options options = {});
+  };
+
+}
@@ -0,0 +1,546 @@
+#include "trace.hpp"
+#include "pmu.hpp"
+
+#include <daisa/instruction.hpp>
+
+#include <algorithm>
+#include <optional>
+#include <span>
+#include <utility>
+
+using namespace daisa;
+using namespace daisa::interpreter;
+
+struct TraceCache::Context {
+  Memory& mem;
+  CpuState& state;
+  RegisterPage& registers;
+  Callbacks const& callbacks;
+  Options const& options;
+  TraceCache& cache;
+  // a store which makes the trace stop leaves the rest of its work to be done afterwards
+  /// the page of a trace which was written to
+  std::optional<u8> wroteCode = std::nullopt;
+  /// an address and value stored to a device
+  std::optional<std::pair<u16, u8>> mmio = std::nullopt;
+};
+
+namespace {
+
+  using Context = TraceCache::Context;
+  using Op = TraceCache::Op;
+  using Handler = TraceCache::Handler;
+
+  // each handler does exactly what interpret does for its instruction, with the argument already picked apart:
+  //   Imm handlers take it from the immediate, and the others from the resolved register
+
+  template <bool Imm>
+  u8 arg(Context& c, Op const& op) {
+    if constexpr (Imm)
+      return op.imm;
+    else
+      return c.registers.addressable[op.reg];
+  }
+  u8& reg(Context& c, Op const& op) { return c.registers.addressable[op.reg]; }
+
+  bool store(Context& c, u8 seg, u8 off, u8 val) {
+    c.mem.paged[seg][off] = val;
+    auto const& options = c.options;
+    if (options.dirtyPages)
+      (*options.dirtyPages)[seg] = true;
+    bool keepGoing = true;
+    if (c.cache.isCode(seg, off)) {
+      c.wroteCode = seg;
+      keepGoing = false;
+    }
+    if (options.mmioPages && (*options.mmioPages)[seg] && c.callbacks.mmioWrite) {
+      c.mmio = { static_cast<u16>((seg << 8) | off), val };
+      keepGoing = false;
+    }
+    return keepGoing;
+  }
+
+  template <bool Flags>
+  void updateFlags(Context& c, u8 val) {
+    if constexpr (Flags) {
+      c.registers.flags.z = val == 0;
+      c.registers.flags.n = (val & 0x80) != 0;
+    }
+  }
+  template <bool Flags>
+  void addVal(Context& c, u8& val, u8 amt, bool carry) {
+    auto sum = static_cast<i16>(val) + static_cast<i16>(amt) + (carry ? 1 : 0);
+    if constexpr (Flags) {
+      auto res = static_cast<u8>(sum);
+      updateFlags<true>(c, res);
+      c.registers.flags.o = (val & 0x80) == (amt & 0x80) && (val & 0x80) != (res & 0x80);
+      c.registers.flags.c = (sum & 0x100) != 0;
+    }
+    val = static_cast<u8>(sum & 0xff);
+  }
+  template <bool Flags>
+  void subVal(Context& c, u8& val, u8 amt) {
+    auto sum = static_cast<i16>(val) - static_cast<i16>(amt);
+    if constexpr (Flags) {
+      auto res = static_cast<u8>(sum);
+      updateFlags<true>(c, res);
+      c.registers.flags.o = (val & 0x80) == (amt & 0x80) && (val & 0x80) != (res & 0x80);
+      c.registers.flags.c = (sum & 0x100) != 0;
+    }
+    val = static_cast<u8>(sum & 0xff);
+  }
+
+  bool nop(Context&, Op const&) { return true; }
+
+  template <bool Imm>
+  bool jn(Context& c, Op const& op) {
+    c.registers.ip = arg<Imm>(c, op);
+    return true;
+  }
+  template <Condition Flag, bool Negated>
+  bool jc(Context& c, Op const& op) {
+    auto const& flags = c.registers.flags;
+    bool value;
+    if constexpr (Flag == Condition::Zero) value = flags.z;
+    else if constexpr (Flag == Condition::Carry) value = flags.c;
+    else if constexpr (Flag == Condition::Overflow) value = flags.o;
+    else value = flags.n;
+    c.registers.ip = value != Negated ? op.imm : op.next;
+    return true;
+  }
+
+  bool pushStack(Context& c, u8 val) {
+    auto& r = c.registers;
+    bool keepGoing = store(c, r.ss, r.named.sp, val);
+    if (r.named.sp++ == 0xff)
+      r.ss++;
+    if (c.options.pmu)
+      c.options.pmu->pushed(static_cast<u16>((r.ss << 8) | r.named.sp));
+    return keepGoing;
+  }
+  u8 popStack(Context& c) {
+    auto& r = c.registers;
+    if (r.named.sp-- == 0x00)
+      r.ss--;
+    return c.mem.paged[r.ss][r.named.sp];
+  }
+  template <bool Imm>
+  bool push(Context& c, Op const& op) { return pushStack(c, arg<Imm>(c, op)); }
+  bool pushCsr(Context& c, Op const&) { return pushStack(c, c.registers.csr); }
+  bool pop(Context& c, Op const& op) { reg(c, op) = popStack(c); return true; }
+  bool popCsr(Context& c, Op const&) { c.registers.csr = popStack(c); return true; }
+
+  bool ldaCsr(Context& c, Op const&) { c.registers.a = c.registers.csr; return true; }
+  bool staCsr(Context& c, Op const&) { c.registers.csr = c.registers.a; return true; }
+  template <bool Imm>
+  bool ldds(Context& c, Op const& op) { c.registers.ds = arg<Imm>(c, op); return true; }
+  bool stds(Context& c, Op const& op) { reg(c, op) = c.registers.ds; return true; }
+  template <bool Imm>
+  bool ldss(Context& c, Op const& op) { c.registers.ss = arg<Imm>(c, op); return true; }
+  bool stss(Context& c, Op const& op) { reg(c, op) = c.registers.ss; return true; }
+
+  template <bool Imm>
+  bool lda(Context& c, Op const& op) { c.registers.a = arg<Imm>(c, op); return true; }
+  bool sta(Context& c, Op const& op) { reg(c, op) = c.registers.a; return true; }
+  /// Stack addresses through ss, for sp and bp
+  template <bool Imm, bool Stack>
+  bool ldm(Context& c, Op const& op) {
+    c.registers.a = c.mem.paged[Stack ? c.registers.ss : c.registers.ds][arg<Imm>(c, op)];
+    return true;
+  }
+  template <bool Imm, bool Stack>
+  bool stm(Context& c, Op const& op) {
+    return store(c, Stack ? c.registers.ss : c.registers.ds, arg<Imm>(c, op), c.registers.a);
+  }
+
+  bool swp(Context& c, Op const& op) { std::swap(c.registers.a, reg(c, op)); return true; }
+  template <bool Flags>
+  bool incA(Context& c, Op const&) { addVal<Flags>(c, c.registers.a, 1, false); return true; }
+  template <bool Flags>
+  bool decA(Context& c, Op const&) { subVal<Flags>(c, c.registers.a, 1); return true; }
+  template <bool Flags>
+  bool inc(Context& c, Op const& op) { addVal<Flags>(c, reg(c, op), 1, false); return true; }
+  template <bool Flags>
+  bool dec(Context& c, Op const& op) { subVal<Flags>(c, reg(c, op), 1); return true; }
+  template <bool Imm, bool Flags>
+  bool adc(Context& c, Op const& op) {
+    addVal<Flags>(c, c.registers.a, arg<Imm>(c, op), c.registers.flags.c);
+    return true;
+  }
+  template <bool Imm, bool Flags>
+  bool add(Context& c, Op const& op) { addVal<Flags>(c, c.registers.a, arg<Imm>(c, op), false); return true; }
+  template <bool Imm, bool Flags>
+  bool sub(Context& c, Op const& op) { subVal<Flags>(c, c.registers.a, arg<Imm>(c, op)); return true; }
+
+  template <bool Flags>
+  bool shl(Context& c, Op const&) {
+    if constexpr (Flags)
+      c.registers.flags.c = (c.registers.a & 0x80) != 0;
+    updateFlags<Flags>(c, c.registers.a <<= 1);
+    return true;
+  }
+  template <bool Flags>
+  bool shr(Context& c, Op const&) {
+    if constexpr (Flags)
+      c.registers.flags.c = false;
+    updateFlags<Flags>(c, c.registers.a >>= 1);
+    return true;
+  }
+  template <bool Flags>
+  bool sra(Context& c, Op const&) {
+    if constexpr (Flags)
+      c.registers.flags.c = false;
+    auto v = static_cast<i8>(c.registers.a);
+    v >>= 1;
+    updateFlags<Flags>(c, c.registers.a = static_cast<u8>(v));
+    return true;
+  }
+  template <bool Flags>
+  bool rol(Context& c, Op const&) {
+    auto& a = c.registers.a;
+    a = static_cast<u8>((a << 1) | ((a & 0x80) >> 7));
+    updateFlags<Flags>(c, a);
+    return true;
+  }
+  template <bool Flags>
+  bool ror(Context& c, Op const&) {
+    auto& a = c.registers.a;
+    a = static_cast<u8>((a >> 1) | ((a & 0x01) << 7));
+    updateFlags<Flags>(c, a);
+    return true;
+  }
+  template <bool Imm, bool Flags>
+  bool and_(Context& c, Op const& op) {
+    if constexpr (Flags)
+      c.registers.flags.c = c.registers.flags.o = false;
+    updateFlags<Flags>(c, c.registers.a &= arg<Imm>(c, op));
+    return true;
+  }
+  template <bool Imm, bool Flags>
+  bool or_(Context& c, Op const& op) {
+    if constexpr (Flags)
+      c.registers.flags.c = c.registers.flags.o = false;
+    updateFlags<Flags>(c, c.registers.a |= arg<Imm>(c, op));
+    return true;
+  }
+  template <bool Imm, bool Flags>
+  bool xor_(Context& c, Op const& op) {
+    if constexpr (Flags) {
+      c.registers.flags.c = true;
+      c.registers.flags.o = false;
+    }
+    updateFlags<Flags>(c, c.registers.a ^= arg<Imm>(c, op));
+    return true;
+  }
+  template <bool Flags>
+  bool clr(Context& c, Op const&) { updateFlags<Flags>(c, c.registers.a = 0); return true; }
+  bool cflags(Context& c, Op const&) { c.registers.flags = {}; return true; }
+
+  template <bool Flags>
+  bool mul(Context& c, Op const&) {
+    auto& r = c.registers;
+    auto product = static_cast<u16>(r.a * r.named.r1);
+    r.a = static_cast<u8>(product & 0xff);
+    r.named.r1 = static_cast<u8>(product >> 8);
+    if constexpr (Flags) {
+      r.flags.z = product == 0;
+      r.flags.n = (product & 0x8000) != 0;
+      r.flags.c = r.flags.o = r.named.r1 != 0;
+    }
+    return true;
+  }
+  template <bool Mod, bool Flags>
+  bool div(Context& c, Op const&) {
+    auto& r = c.registers;
+    if constexpr (Flags) {
+      r.flags.c = r.named.r1 == 0;
+      r.flags.o = false;
+    }
+    if (r.named.r1 != 0)
+      r.a = static_cast<u8>(Mod ? r.a % r.named.r1 : r.a / r.named.r1);
+    updateFlags<Flags>(c, r.a);
+    return true;
+  }
+  template <bool Add, bool Flags>
+  bool addw(Context& c, Op const&) {
+    auto& r = c.registers;
+    auto x = static_cast<u16>((r.named.r1 << 8) | r.a);
+    auto y = static_cast<u16>((r.named.r3 << 8) | r.named.r2);
+    auto result = static_cast<u16>(Add ? x + y : x - y);
+    r.a = static_cast<u8>(result & 0xff);
+    r.named.r1 = static_cast<u8>(result >> 8);
+    if constexpr (Flags) {
+      r.flags.z = result == 0;
+      r.flags.n = (result & 0x8000) != 0;
+      r.flags.c = Add ? result < x : y > x;
+      r.flags.o = ((Add ? ~(x ^ y) : (x ^ y)) & (x ^ result) & 0x8000) != 0;
+    }
+    return true;
+  }
+
+  bool dsi(Context& c, Op const&) { c.state.intEnabled = false; return true; }
+
+  enum FlagBits : u8 {
+    Z = 1 << 0,
+    C = 1 << 1,
+    O = 1 << 2,
+    N = 1 << 3,
+    AllFlags = Z | C | O | N,
+  };
+
+  /// the flags an instruction sets, and the flags it reads, or which may be read if the trace stops after it
+  std::pair<u8, u8> flagUse(Instruction insn) {
+    switch (insn.opcode()) {
+      case OpCode::INC_A: case OpCode::DEC_A: case OpCode::INC: case OpCode::DEC:
+      case OpCode::ADD: case OpCode::SUB: case OpCode::AND: case OpCode::OR: case OpCode::XOR:
+      case OpCode::CFLAGS: case OpCode::MUL: case OpCode::DIV: case OpCode::MOD: case OpCode::ADDW: case OpCode::SUBW:
+        return { AllFlags, 0 };
+      case OpCode::ADC:
+        return { AllFlags, C };
+      case OpCode::SHL: case OpCode::SHR: case OpCode::SRA:
+        return { Z | N | C, 0 };
+      case OpCode::ROL: case OpCode::ROR: case OpCode::CLR:
+        return { Z | N, 0 };
+      case OpCode::STM: case OpCode::PUSH: case OpCode::PUSH_CSR:
+        // a store to code or a device leaves the trace, and what runs next may read any flag
+        return { 0, AllFlags };
+      case OpCode::Jc:
+        switch (static_cast<Condition>(static_cast<u8>(insn.cond_argument()) & 0b110)) {
+          case Condition::Zero: return { 0, Z };
+          case Condition::Carry: return { 0, C };
+          case Condition::Overflow: return { 0, O };
+          default: return { 0, N };
+        }
+      default:
+        return { 0, 0 };
+    }
+  }
+
+  /// picks the handlers for an instruction; returns nothing if it can't be in a trace
+  std::optional<std::pair<Handler, Handler>> handlers(Instruction insn, bool flagsLive) {
+    bool imm = insn.has_argument() && insn.has_reg_argument() && insn.reg_argument() == Register::Imm;
+    bool stack = insn.has_reg_argument() && (insn.reg_argument() == Register::SP || insn.reg_argument() == Register::BP);
+    auto same = [](Handler h) { return std::pair{ h, h }; };
+    auto flagged = [&](Handler exact, Handler dead) { return std::pair{ exact, flagsLive ? exact : dead }; };
+
+    switch (insn.opcode()) {
+      case OpCode::NOP: return same(&nop);
+      case OpCode::JN: return same(imm ? &jn<true> : &jn<false>);
+      case OpCode::Jc:
+        switch (insn.cond_argument()) {
+          case Condition::Zero: return same(&jc<Condition::Zero, false>);
+          case Condition::NotZero: return same(&jc<Condition::Zero, true>);
+          case Condition::Carry: return same(&jc<Condition::Carry, false>);
+          case Condition::NotCarry: return same(&jc<Condition::Carry, true>);
+          case Condition::Overflow: return same(&jc<Condition::Overflow, false>);
+          case Condition::NotOverflow: return same(&jc<Condition::Overflow, true>);
+          case Condition::Negative: return same(&jc<Condition::Negative, false>);
+          case Condition::NotNegative: return same(&jc<Condition::Negative, true>);
+        }
+        return std::nullopt;
+
+      case OpCode::PUSH: return same(imm ? &push<true> : &push<false>);
+      case OpCode::PUSH_CSR: return same(&pushCsr);
+      case OpCode::POP: return same(&pop);
+      case OpCode::POP_CSR: return same(&popCsr);
+      case OpCode::LDA_CSR: return same(&ldaCsr);
+      case OpCode::STA_CSR: return same(&staCsr);
+      case OpCode::LDDS: return same(imm ? &ldds<true> : &ldds<false>);
+      case OpCode::STDS: return same(&stds);
+      case OpCode::LDSS: return same(imm ? &ldss<true> : &ldss<false>);
+      case OpCode::STSS: return same(&stss);
+      case OpCode::LDA: return same(imm ? &lda<true> : &lda<false>);
+      case OpCode::STA: return same(&sta);
+      case OpCode::LDM: return same(imm ? &ldm<true, false> : stack ? &ldm<false, true> : &ldm<false, false>);
+      case OpCode::STM: return same(imm ? &stm<true, false> : stack ? &stm<false, true> : &stm<false, false>);
+      case OpCode::SWP: return same(&swp);
+
+      case OpCode::INC_A: return flagged(&incA<true>, &incA<false>);
+      case OpCode::DEC_A: return flagged(&decA<true>, &decA<false>);
+      case OpCode::INC: return flagged(&inc<true>, &inc<false>);
+      case OpCode::DEC: return flagged(&dec<true>, &dec<false>);
+      case OpCode::ADC: return imm ? flagged(&adc<true, true>, &adc<true, false>) : flagged(&adc<false, true>, &adc<false, false>);
+      case OpCode::ADD: return imm ? flagged(&add<true, true>, &add<true, false>) : flagged(&add<false, true>, &add<false, false>);
+      case OpCode::SUB: return imm ? flagged(&sub<true, true>, &sub<true, false>) : flagged(&sub<false, true>, &sub<false, false>);
+      case OpCode::SHL: return flagged(&shl<true>, &shl<false>);
+      case OpCode::SHR: return flagged(&shr<true>, &shr<false>);
+      case OpCode::SRA: return flagged(&sra<true>, &sra<false>);
+      case OpCode::ROL: return flagged(&rol<true>, &rol<false>);
+      case OpCode::ROR: return flagged(&ror<true>, &ror<false>);
+      case OpCode::AND: return imm ? flagged(&and_<true, true>, &and_<true, false>) : flagged(&and_<false, true>, &and_<false, false>);
+      case OpCode::OR: return imm ? flagged(&or_<true, true>, &or_<true, false>) : flagged(&or_<false, true>, &or_<false, false>);
+      case OpCode::XOR: return imm ? flagged(&xor_<true, true>, &xor_<true, false>) : flagged(&xor_<false, true>, &xor_<false, false>);
+      case OpCode::CLR: return flagged(&clr<true>, &clr<false>);
+      case OpCode::CFLAGS: return flagged(&cflags, &nop);
+      case OpCode::MUL: return flagged(&mul<true>, &mul<false>);
+      case OpCode::DIV: return flagged(&div<false, true>, &div<false, false>);
+      case OpCode::MOD: return flagged(&div<true, true>, &div<true, false>);
+      case OpCode::ADDW: return flagged(&addw<true, true>, &addw<true, false>);
+      case OpCode::SUBW: return flagged(&addw<false, true>, &addw<false, false>);
+
+      case OpCode::DSI: return same(&dsi);
+
+      // anything else changes cs, needs interrupts to be checked, or waits for the host, so ends the trace
+      default:
+        return std::nullopt;
+    }
+  }
+
+}
+
+void TraceCache::invalidate(u8 page) noexcept {
+  if (auto& traces = pages[page]) {
+    count -= static_cast<std::size_t>(std::count_if(traces->traces.begin(), traces->traces.end(),
+      [](auto const& trace) { return trace != nullptr; }));
+    traces.reset();
+  }
+  std::fill_n(heat.begin() + page * 256, 256, 0);
+}
+
+void TraceCache::clear() noexcept {
+  for (auto page = 0u; page < pages.size(); page++)
+    invalidate(static_cast<u8>(page));
+}
+
+void TraceCache::compile(Memory const& mem, u16 addr, Options const& options) {
+  auto seg = static_cast<u8>(addr >> 8);
+  std::span<u8 const> code = mem.paged[seg];
+
+  // straight-line code up to the first jump or untraceable instruction; the trace stays in the segment, so that
+  //   only ip ever changes
+  struct Decoded {
+    Instruction insn;
+    u8 ip;
+  };
+  std::vector<Decoded> decoded;
+  bool jumps = false;
+  for (unsigned ip = addr & 0xff; ip < code.size();) {
+    auto disasm = Instruction::disassemble(code.subspan(ip));
+    if (!disasm || ip + disasm.instruction->length() >= code.size() || !handlers(*disasm.instruction, true))
+      break;
+    auto insn = *disasm.instruction;
+    if (opcode_is_extension(insn.opcode()) && !options.extendedArithmetic)
+      break;
+    // the pmu times how long interrupts are masked from the cycle count at dsi, which a trace doesn't keep
+    if (insn.opcode() == OpCode::DSI && options.pmu)
+      break;
+    decoded.push_back({ insn, static_cast<u8>(ip) });
+    ip += insn.length();
+    if (insn.opcode() == OpCode::JN || insn.opcode() == OpCode::Jc) {
+      jumps = true;
+      break;
+    }
+  }
+  if (decoded.empty())
+    return;
+
+  // every flag is live when the trace ends; going backwards, a flag is dead from where it is set up to where it was
+  //   last read
+  auto trace = std::make_unique<Trace>(Trace{ addr, jumps, 0, std::vector<Op>(decoded.size()) });
+  u8 live = AllFlags;
+  for (auto i = decoded.size(); i-- > 0;) {
+    auto [insn, ip] = decoded[i];
+    auto [sets, reads] = flagUse(insn);
+    auto [exact, fast] = *handlers(insn, (sets & live) != 0);
+    live = static_cast<u8>((live & ~sets) | reads);
+
+    u8 arg = 0;
+    if (insn.has_reg_argument())
+      arg = static_cast<u8>(insn.reg_argument());
+    else if (insn.has_cond_argument())
+      arg = static_cast<u8>(insn.cond_argument());
+    trace->ops[i] = Op{
+      exact,
+      fast,
+      arg,
+      insn.has_immediate() ? insn.immedidate() : u8(0),
+      static_cast<u8>(ip + insn.length()),
+      cycle_table[code[ip]],
+    };
+    trace->cycles += trace->ops[i].cycles;
+  }
+
+  auto& page = pages[seg];
+  if (!page)
+    page = std::make_unique<Page>();
+  for (auto ip = addr & 0xff; ip < trace->ops.back().next; ip++)
+    page->code[ip] = true;
+  if (!page->traces[addr & 0xff])
+    count++;
+  page->traces[addr & 0xff] = std::move(trace);
+}
+
+TraceCache::Exit TraceCache::run(
+  Trace const& trace,
+  Memory& mem,
+  CpuState& state,
+  Callbacks const& callbacks,
+  Options const& options,
+  u64 limit
+) {
+  auto& registers = state.registers;
+  Context c{ mem, state, registers, callbacks, options, *this };
+  auto const* ops = trace.ops.data();
+  auto length = trace.ops.size();
+  auto start = static_cast<u8>(trace.start & 0xff);
+  u64 retired = 0;
+
+  // finishes a store which made the trace stop; the trace may not exist afterwards
+  auto finishStore = [&] {
+    if (c.wroteCode)
+      invalidate(*c.wroteCode);
+    if (c.mmio) {
+      if (options.pmu)
+        options.pmu->sync(state);
+      mmioWrite(mem, c.mmio->first, c.mmio->second, callbacks, options);
+    }
+  };
+  auto leave = [&] {
+    jumpedTo(mem, static_cast<u16>((registers.cs << 8) | registers.ip), options); // so that a hot exit gets a trace too
+    return Exit{ retired, false };
+  };
+  auto again = [&] { return registers.ip == start && (!limit || retired + length <= limit); };
+
+  if (!state.intEnabled || !callbacks.pollInterrupt) {
+    // nothing in a trace enables interrupts, so nothing can see the flags which are overwritten before being read,
+    //   and ip, cycles and retired need only be brought up to date at the end of each pass
+    do {
+      std::size_t i = 0;
+      while (i < length && ops[i].fast(c, ops[i]))
+        i++;
+      if (i < length) {
+        for (std::size_t j = 0; j <= i; j++)
+          state.cycles += ops[j].cycles;
+        state.retired += i + 1;
+        retired += i + 1;
+        registers.ip = ops[i].next;
+        finishStore();
+        return Exit{ retired, false };
+      }
+      state.cycles += trace.cycles;
+      state.retired += length;
+      retired += length;
+      if (!trace.jumps)
+        registers.ip = ops[length - 1].next;
+    } while (again());
+    return leave();
+  }
+
+  do {
+    for (std::size_t i = 0; i < length; i++) {
+      auto const& op = ops[i];
+      registers.ip = op.next;
+      bool keepGoing = op.exact(c, op);
+      state.cycles += op.cycles;
+      state.retired++;
+      retired++;
+      if (!keepGoing)
+        finishStore();
+      if (state.intEnabled && callbacks.pollInterrupt(mem, state))
+        return Exit{ retired, true };
+      if (!keepGoing)
+        return Exit{ retired, false };
+    }
+  } while (again());
+  return leave();
+}
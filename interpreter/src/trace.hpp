@@ -0,0 +1,110 @@
+#pragma once
+
+#include "types.hpp"
+#include "interp.hpp"
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace daisa::interpreter {
+
+  /// @brief Compiles hot loops into traces, which interpret runs instead of decoding each instruction.
+  /// @note A trace is a run of straight-line code in one segment, up to and including a near jump, compiled into an
+  ///   array of handlers with their operands already decoded. Loop heads are found by counting taken backwards jumps
+  ///   and trace exits, and a trace which jumps back to its own start runs again without leaving.
+  ///   Writes by the guest or a device to a page with traces in it throw them away, but anything else which writes
+  ///   to code (the host, or another core) must call invalidate or clear. Traces follow the Options they were
+  ///   compiled with, so a cache should only be used with one setting of Options::extendedArithmetic and
+  ///   Options::pmu.
+  class TraceCache {
+  public:
+    /// @param[in]  threshold  The number of times an address must be jumped to before a trace is compiled there.
+    explicit TraceCache(u8 threshold = 16) noexcept : threshold(threshold == 0 ? 1 : threshold) {}
+
+    TraceCache(TraceCache const&) = delete;
+    TraceCache& operator=(TraceCache const&) = delete;
+
+    /// @brief Throws away every trace compiled from a page.
+    void invalidate(u8 page) noexcept;
+    /// @brief Throws away every trace.
+    void clear() noexcept;
+
+    /// @brief The number of traces currently compiled.
+    [[nodiscard]] std::size_t size() const noexcept { return count; }
+
+    // the rest is used by interpret
+
+    struct Context;
+    struct Op;
+    /// runs one instruction; returns false if it stored to a trace or a device, so the trace must be left
+    using Handler = bool (*)(Context&, Op const&);
+
+    struct Op {
+      /// computes every flag, for when an interrupt may see them
+      Handler exact;
+      /// skips flags which are overwritten later in the trace before being read
+      Handler fast;
+      /// the register index, or for jc, the condition
+      u8 reg;
+      u8 imm;
+      /// ip after the instruction, if it doesn't jump
+      u8 next;
+      u8 cycles;
+    };
+
+    struct Trace {
+      u16 start;
+      /// whether the last op is a jump, which leaves ip wherever it goes
+      bool jumps;
+      u64 cycles;
+      std::vector<Op> ops;
+    };
+
+    struct Exit {
+      u64 retired;
+      /// an interrupt was raised after the last instruction, and must be taken
+      bool interrupt;
+    };
+
+    [[nodiscard]] Trace const* find(u16 addr) const noexcept {
+      auto const& page = pages[addr >> 8];
+      return page ? page->traces[addr & 0xff].get() : nullptr;
+    }
+    /// counts a jump to an address, compiling a trace there once it is hot
+    void jumpedTo(Memory const& mem, u16 addr, Options const& options) {
+      if (++heat[addr] == threshold)
+        compile(mem, addr, options);
+      else if (heat[addr] == 0)
+        heat[addr] = threshold; // saturate, so that a failed compile isn't tried again
+    }
+    /// whether a byte was compiled into a trace
+    [[nodiscard]] bool isCode(u8 seg, u8 off) const noexcept { return pages[seg] && pages[seg]->code[off]; }
+    /// notes a write by the guest, throwing away the traces in the page if it was to one of them
+    void written(u8 seg, u8 off) noexcept {
+      if (isCode(seg, off))
+        invalidate(seg);
+    }
+
+    /// @brief Runs a trace, looping while it jumps back to its start.
+    /// @param[in]  limit  The most instructions to retire, or 0 for no limit; must be at least the trace's length.
+    Exit run(Trace const& trace, Memory& mem, CpuState& state, Callbacks const& callbacks, Options const& options,
+      u64 limit);
+
+  private:
+    struct Page {
+      std::array<std::unique_ptr<Trace>, 256> traces;
+      std::bitset<256> code;
+    };
+
+    u8 threshold;
+    std::size_t count = 0;
+    std::array<std::unique_ptr<Page>, 256> pages;
+    std::array<u8, 256*256> heat = {};
+
+    void compile(Memory const& mem, u16 addr, Options const& options);
+  };
+
+}
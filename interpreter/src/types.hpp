@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <bitset>
 
 #include <daisa/types.hpp>
 
@@ -50,4 +51,45 @@ namespace daisa::interpreter {
   };
   static_assert(sizeof(Memory) == 256*256, "Unexpected size of Memory object");
 
+  /// one bit for each page of Memory
+  using PageMask = std::bitset<256>;
+
+  /// edge hit counts, indexed by a hash of the previous and current instruction addresses
+  using CoverageMap = std::array<u8, 1 << 13>;
+
+  struct CpuState {
+    RegisterPage registers = RegisterPage();
+    bool intEnabled = true;
+    /// set by hlt, and cleared when an interrupt is taken
+    bool halted = false;
+    /// total cycles elapsed, including any skipped while idle
+    u64 cycles = 0;
+    /// number of instructions retired
+    u64 retired = 0;
+  };
+
+  /// execution breakpoints and data watchpoints, kept as a bitmap per page; only pages flagged as
+  ///   having any set are looked at, so untouched pages cost one load per check
+  struct Breakpoints {
+    struct PageSet {
+      std::array<bool, 256> flagged = {};
+      std::array<std::bitset<256>, 256> bits = {};
+
+      [[nodiscard]] bool test(u8 seg, u8 off) const noexcept { return flagged[seg] && bits[seg][off]; }
+      void set(u16 addr) noexcept {
+        bits[addr >> 8][addr & 0xff] = true;
+        flagged[addr >> 8] = true;
+      }
+      void reset(u16 addr) noexcept {
+        auto& page = bits[addr >> 8];
+        page[addr & 0xff] = false;
+        flagged[addr >> 8] = page.any();
+      }
+    };
+
+    PageSet execute;
+    PageSet read;
+    PageSet write;
+  };
+
 }
\ No newline at end of file